@@ -3,12 +3,50 @@
 #include <vector>
 #include <string>
 #include <algorithm>
-#include <iomanip>
 #include <cmath>
 #include <sstream> 
 #include <stdexcept> 
 #include <limits> 
 #include <numeric> // Required for std::accumulate
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <set>
+#include <list>
+#include <string_view>
+#include <charconv>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <queue>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <random>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+// Memory mapping (POSIX only, see MappedFile), fsync for durable writes, file locks
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -17,677 +55,4531 @@ const string PRODUCTS_FILE = "products.json";
 const string USERS_FILE = "users.json";
 const string REVIEWS_FILE = "reviews.json";
 
+// Purchase history, one record per user; optional, a missing file means no purchases
+const string PURCHASES_FILE = "purchases.json";
+
+// Append-only log of changes made since the JSON files were last written
+const string MUTATIONS_LOG_FILE = "mutations.log";
+
+// Once the log holds this many records it is folded back into the JSON files
+const int COMPACT_LOG_RECORDS = 1000;
+
+// Advisory lock shared by every process working on the data files in this directory
+const string LOCK_FILE = "data.lock";
+
+// Default binary snapshot written by --snapshot-save and read by --snapshot-load
+const string SNAPSHOT_FILE = "snapshot.bin";
+
+// Number of recommendations returned when --recommend is given no k
+const int DEFAULT_RECOMMENDATIONS = 3;
+
+// Most similar products kept per product for --strategy itemcf
+const int ITEMCF_NEIGHBOURS = 20;
+
+// Rating an unreviewed purchase stands in for when it votes in --strategy itemcf
+const int PURCHASE_IMPLICIT_RATING = 3;
+
+// Memory the resident engine may spend on cached --recommend replies (--cache-mb)
+const size_t DEFAULT_RECOMMENDATION_CACHE_BYTES = 16 << 20;
+
+// A sharded data root holds one data directory per shard: shard-0, shard-1, ...
+const string SHARD_DIR_PREFIX = "shard-";
+
 // --- Utility Functions for JSON and String Parsing ---
 
 /**
- * Escapes special characters in a string for safe JSON inclusion.
+ * Appends `s` to `out` with JSON special characters escaped. Runs of ordinary
+ * characters are copied in one piece; only quotes, backslashes and control
+ * characters are handled one at a time.
  */
-string escapeJsonString(const string& s) {
-    string escaped;
-    for (char c : s) {
+void appendJsonEscaped(string& out, string_view s) {
+    static const char* hex = "0123456789abcdef";
+    size_t run = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out.append(s.data() + run, i - run);
+        run = i + 1;
         switch (c) {
-            case '"': escaped += "\\\""; break;
-            case '\\': escaped += "\\\\"; break;
-            case '\n': escaped += "\\n"; break;
-            case '\r': escaped += "\\r"; break;
-            case '\t': escaped += "\\t"; break;
-            default: escaped += c;
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xF];
         }
     }
-    return escaped;
+    out.append(s.data() + run, s.size() - run);
 }
 
 /**
- * Simple helper to extract a value associated with a key from a raw JSON string.
+ * Escapes special characters in a string for safe JSON inclusion.
  */
-string extractJsonValue(const string& json, const string& key) {
-    string search = "\"" + key + "\":";
-    size_t start = json.find(search);
-    if (start == string::npos) return "";
-
-    start += search.length();
-    
-    // Skip whitespace
-    while (start < json.length() && isspace(json[start])) start++;
-
-    if (start >= json.length()) return "";
-
-    // If it's a string value
-    if (json[start] == '"') {
-        start++;
-        size_t end = json.find('"', start);
-        if (end != string::npos) {
-            string val = json.substr(start, end - start);
-            
-            // Unescape the string content if needed (simplified)
-            size_t pos = val.find("\\\"");
-            while(pos != string::npos) {
-                val.replace(pos, 2, "\"");
-                pos = val.find("\\\"", pos + 1);
-            }
-            return val;
-        }
-    } 
-    // If it's a numeric or boolean value
-    else {
-        size_t end = json.find_first_of(" \t\n\r,}", start);
-        if (end != string::npos) return json.substr(start, end - start);
-    }
-    return "";
+string escapeJsonString(string_view s) {
+    string escaped;
+    appendJsonEscaped(escaped, s);
+    return escaped;
 }
 
-
-// --- 1. Review Class ---
-class Review {
+/**
+ * Output buffer for building JSON responses. Records append themselves through
+ * toJson(JsonWriter&), numbers are formatted with to_chars straight into the
+ * buffer, so a response of any size costs only the buffer's own growth.
+ * Nothing is validated: callers write the punctuation themselves.
+ *
+ * A writer built on a stream passes its output on whenever about `chunkBytes`
+ * have gathered, so a large response never sits in memory as a whole and the
+ * reader gets its first bytes while the rest is produced. With a `sinkLock`
+ * the lock is taken at the first chunk and held until finish(): responses
+ * from several threads sharing one stream come out whole, one after another.
+ */
+class JsonWriter {
 private:
-    int user_id;
-    int product_id;
-    int rating; // 1-5
-    string comment;
+    string buffer;
+    ostream* sink = nullptr;
+    mutex* sinkLock = nullptr;
+    unique_lock<mutex> holding;
+    size_t chunkBytes = 0;
+    size_t flushedBytes = 0;
+
+    void spill() {
+        if (sink && buffer.size() >= chunkBytes) flush();
+    }
 
 public:
-    Review(int uid, int pid, int r, const string& c) 
-        : user_id(uid), product_id(pid), rating(r), comment(c) {}
+    JsonWriter() = default;
+    explicit JsonWriter(ostream& sink, mutex* sinkLock = nullptr, size_t chunkBytes = 64 * 1024)
+        : sink(&sink), sinkLock(sinkLock), chunkBytes(chunkBytes) {
+        buffer.reserve(chunkBytes + chunkBytes / 4);
+    }
+    ~JsonWriter() { finish(); }
 
-    // Getters
-    int getUserId() const { return user_id; }
-    int getProductId() const { return product_id; }
-    int getRating() const { return rating; }
-    string getComment() const { return comment; }
+    /** Passes what has gathered so far on to the stream (a no-op without one). */
+    void flush() {
+        if (!sink || buffer.empty()) return;
+        if (sinkLock && !holding.owns_lock()) holding = unique_lock<mutex>(*sinkLock);
+        sink->write(buffer.data(), static_cast<streamsize>(buffer.size()));
+        flushedBytes += buffer.size();
+        buffer.clear();
+    }
 
-    // JSON serialization
-    string toJson() const {
-        ostringstream oss;
-        oss << "{"
-            << "\"user_id\":" << user_id << ","
-            << "\"product_id\":" << product_id << ","
-            << "\"rating\":" << rating << ","
-            << "\"comment\":\"" << escapeJsonString(comment) << "\""
-            << "}";
-        return oss.str();
+    /** Ends a streamed response: flushes the stream and releases the sink lock. */
+    void finish() {
+        flush();
+        if (sink && (!sinkLock || holding.owns_lock())) sink->flush();
+        if (holding.owns_lock()) holding.unlock();
+    }
+
+    JsonWriter& raw(string_view text) { buffer.append(text.data(), text.size()); spill(); return *this; }
+    JsonWriter& raw(char c) { buffer += c; spill(); return *this; }
+
+    /** An integer in decimal. */
+    template <typename Int, typename = enable_if_t<is_integral_v<Int>>>
+    JsonWriter& number(Int value) {
+        char digits[24];
+        auto written = to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, written.ptr);
+        spill();
+        return *this;
+    }
+
+    /** A double with `decimals` digits after the point, as printf("%.*f") would write it. */
+    JsonWriter& fixed(double value, int decimals) {
+        char digits[64];
+        auto written = to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, decimals);
+        if (written.ec == errc()) {
+            buffer.append(digits, written.ptr);
+        } else {
+            // Too long for the stack buffer (|value| beyond ~1e50); rare enough to allocate
+            vector<char> wide(static_cast<size_t>(snprintf(nullptr, 0, "%.*f", decimals, value)) + 1);
+            snprintf(wide.data(), wide.size(), "%.*f", decimals, value);
+            buffer.append(wide.data());
+        }
+        spill();
+        return *this;
+    }
+
+    /** String contents, escaped, without the quotes (for text embedded in a longer string). */
+    JsonWriter& escaped(string_view text) {
+        appendJsonEscaped(buffer, text);
+        spill();
+        return *this;
+    }
+
+    /** A JSON string: quotes plus escaped contents. */
+    JsonWriter& quoted(string_view text) {
+        buffer += '"';
+        appendJsonEscaped(buffer, text);
+        buffer += '"';
+        spill();
+        return *this;
+    }
+
+    void reserve(size_t bytes) {
+        if (!sink) buffer.reserve(bytes); // A streaming writer never holds more than a chunk
+    }
+    size_t size() const { return buffer.size(); }
+    size_t flushed() const { return flushedBytes; } // Bytes passed on to the stream so far
+    string_view view() const { return buffer; }
+    void clear() { buffer.clear(); } // Keeps the capacity for the next response
+    void truncate(size_t bytes) {
+        if (buffer.size() > bytes) buffer.resize(bytes); // Only what is not flushed yet can be taken back
     }
+    string take() { return move(buffer); }
 };
 
-// --- 2. Product Class ---
-class Product {
+/** A single record's JSON as its own string, for one-off uses such as log lines. */
+template <typename Record>
+string toJsonString(const Record& record) {
+    JsonWriter out;
+    record.toJson(out);
+    return out.take();
+}
+
+/**
+ * Text that is either a view into a loaded data file or an owned string.
+ * Loaded records borrow their text from the file mapping (no copy); anything
+ * created at runtime owns it. A record's borrowed text is only valid while
+ * the mapping it came from is alive.
+ */
+class TextRef {
 private:
-    int id;
-    string name;
-    string category;
-    double price;
+    string_view borrowed;
+    string owned;
+    bool isBorrowed = false;
 
 public:
-    Product(int id, const string& name, const string& category, double price)
-        : id(id), name(name), category(category), price(price) {}
-
-    // Getters
-    int getId() const { return id; }
-    string getName() const { return name; }
-    string getCategory() const { return category; }
-    double getPrice() const { return price; }
+    TextRef() = default;
+    TextRef(string text) : owned(move(text)) {}
+    TextRef(const char* text) : owned(text) {}
 
-    // JSON serialization (without rating, as it's calculated externally)
-    string toJson() const {
-        ostringstream oss;
-        oss << fixed << setprecision(2);
-        oss << "{"
-            << "\"id\":" << id << ","
-            << "\"name\":\"" << escapeJsonString(name) << "\","
-            << "\"category\":\"" << escapeJsonString(category) << "\","
-            << "\"price\":" << price
-            << "}";
-        return oss.str();
+    static TextRef borrow(string_view text) {
+        TextRef ref;
+        ref.borrowed = text;
+        ref.isBorrowed = true;
+        return ref;
     }
+
+    string_view view() const { return isBorrowed ? borrowed : string_view(owned); }
+    bool borrowsText() const { return isBorrowed; }
 };
 
-// --- 3. User Class ---
-class User {
+/**
+ * Append-only storage for text that has no buffer to borrow from (escaped or
+ * newly added strings). Text is packed into large blocks that never move, so the
+ * returned views stay valid until clear().
+ */
+class TextArena {
 private:
-    int id;
-    string name;
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    vector<unique_ptr<char[]>> blocks;
+    char* current = nullptr; // Block that small strings are packed into
+    size_t used = 0;
+    size_t capacity = 0;
 
 public:
-    User(int id, const string& name) : id(id), name(name) {}
+    string_view store(string_view text) {
+        if (text.empty()) return {};
+        if (text.size() > BLOCK_SIZE / 4) {
+            // Large strings get a block of their own and leave the current one open
+            blocks.emplace_back(new char[text.size()]);
+            memcpy(blocks.back().get(), text.data(), text.size());
+            return string_view(blocks.back().get(), text.size());
+        }
+        if (capacity - used < text.size()) {
+            blocks.emplace_back(new char[BLOCK_SIZE]);
+            used = 0;
+            capacity = BLOCK_SIZE;
+            current = blocks.back().get();
+        }
+        char* out = current + used;
+        memcpy(out, text.data(), text.size());
+        used += text.size();
+        return string_view(out, text.size());
+    }
 
-    // Getters
-    int getId() const { return id; }
-    string getName() const { return name; }
-    
-    // JSON serialization
-    string toJson() const {
-        ostringstream oss;
-        oss << "{"
-            << "\"id\":" << id << ","
-            << "\"name\":\"" << escapeJsonString(name) << "\""
-            << "}";
-        return oss.str();
+    void clear() {
+        blocks.clear();
+        current = nullptr;
+        used = capacity = 0;
     }
 };
 
-// --- 4. RecommendationSystem Class ---
-class RecommendationSystem {
+/**
+ * Interned text: equal strings are stored once (in a TextArena) and every
+ * intern() of them returns the same view, valid until clear().
+ */
+class StringPool {
 private:
-    vector<Product> products;
-    vector<User> users;
-    vector<Review> reviews;
-    int nextProductId = 1000;
-    int nextUserId = 100;
+    TextArena arena;
+    unordered_set<string_view> texts;
 
-    /**
-     * Attempts to create initial default data if no files exist.
-     */
-    void createDefaultData() {
-        products.emplace_back(1000, "Mechanical Keyboard", "Electronics", 99.99);
-        products.emplace_back(1001, "Wireless Mouse", "Electronics", 45.50);
-        products.emplace_back(1002, "The Silent Patient Book", "Books", 12.00);
-        products.emplace_back(1003, "Blue Hoodie", "Apparel", 65.00);
-        nextProductId = 1004;
+public:
+    string_view intern(string_view text) {
+        auto found = texts.find(text);
+        if (found != texts.end()) return *found;
+        string_view stored = arena.store(text);
+        texts.insert(stored);
+        return stored;
+    }
 
-        users.emplace_back(100, "Alice Johnson");
-        users.emplace_back(101, "Bob Smith");
-        nextUserId = 102;
+    void clear() {
+        texts.clear();
+        arena.clear();
+    }
+};
+
+/** Where a record's text ends up: borrowed text as is, anything else copied into `arena`. */
+string_view storeText(TextArena& arena, const TextRef& text) {
+    return text.borrowsText() ? text.view() : arena.store(text.view());
+}
+
+/**
+ * Single-pass JSON reader working directly on the input buffer.
+ * Callers walk arrays and objects with callbacks and pull typed values out of
+ * each field, so records are filled without copying the text they came from.
+ * A syntax error stops the reader; ok() reports it and offset() says where.
+ */
+class JsonReader {
+private:
+    string_view text;
+    size_t pos = 0;
+    bool failed = false;
+    size_t errorAt = 0;
+    string keyBuffer; // Only used for keys that contain escapes
 
-        reviews.emplace_back(100, 1000, 5, "Excellent keyboard for coding.");
-        reviews.emplace_back(100, 1001, 4, "Reliable mouse, good battery life.");
-        reviews.emplace_back(101, 1002, 3, "A decent thriller, a bit slow.");
-        reviews.emplace_back(101, 1003, 5, "Comfy and warm!");
+    void fail() {
+        if (!failed) errorAt = pos;
+        failed = true;
+        pos = text.size();
     }
 
+    void skipWhitespace() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\n' || text[pos] == '\r' || text[pos] == '\t')) pos++;
+    }
 
-    // --- Persistence Methods ---
+    bool consume(char c) {
+        skipWhitespace();
+        if (pos < text.size() && text[pos] == c) { pos++; return true; }
+        return false;
+    }
 
-    /** Reads all data from JSON files into memory. */
-    void loadData() {
-        products.clear();
-        users.clear();
-        reviews.clear();
-        
-        // Helper to read all lines from a file
-        auto readAll = [](const string& filename) {
-            ifstream ifs(filename);
-            if (!ifs.is_open()) {
-                cerr << "DEBUG C++: File not found or failed to open: " << filename << endl; 
-                return string("[]"); 
-            }
-            if (ifs.peek() == ifstream::traits_type::eof()) {
-                return string("[]");
-            }
-            return string((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
-        };
-        
-        // Simple JSON array to vector parser
-        auto parseArray = [](const string& raw_json) {
-            vector<string> items;
-            if (raw_json.empty() || raw_json.size() < 2 || raw_json[0] != '[' || raw_json.back() != ']') {
-                return items;
-            }
-            string content = raw_json.substr(1, raw_json.size() - 2); 
-            
-            size_t start = 0;
-            int bracket_count = 0;
-            for(size_t i = 0; i < content.length(); ++i) {
-                if(content[i] == '{') bracket_count++;
-                else if(content[i] == '}') bracket_count--;
-                
-                if(bracket_count == 0 && content[i] == ',') {
-                    items.push_back(content.substr(start, i - start));
-                    start = i + 1;
-                }
-            }
-            if(start < content.length()) items.push_back(content.substr(start));
-            
-            for(string& item : items) {
-                 size_t first = item.find_first_not_of(" \t\n\r");
-                 size_t last = item.find_last_not_of(" \t\n\r");
-                 if (string::npos != first) {
-                     item = item.substr(first, (last - first + 1));
-                 } else {
-                     item = ""; 
-                 }
-            }
-             items.erase(std::remove_if(items.begin(), items.end(), [](const std::string& s){ return s.empty() || s.find('{') == std::string::npos; }), items.end());
-            return items;
-        };
-        
-        bool data_loaded = false;
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
 
-        // 1. Load Products
-        for (const auto& raw_obj : parseArray(readAll(PRODUCTS_FILE))) {
-            try {
-                int id = stoi(extractJsonValue(raw_obj, "id"));
-                double price = stod(extractJsonValue(raw_obj, "price"));
-                products.emplace_back(id, extractJsonValue(raw_obj, "name"), 
-                                     extractJsonValue(raw_obj, "category"), price);
-                nextProductId = max(nextProductId, id + 1);
-                data_loaded = true;
-            } catch (...) {}
-        }
-        
-        // 2. Load Users
-        for (const auto& raw_obj : parseArray(readAll(USERS_FILE))) {
-            try {
-                int id = stoi(extractJsonValue(raw_obj, "id"));
-                users.emplace_back(id, extractJsonValue(raw_obj, "name"));
-                nextUserId = max(nextUserId, id + 1);
-                data_loaded = true;
-            } catch (...) {}
+    bool readHex4(unsigned& out) {
+        if (pos + 4 > text.size()) return false;
+        out = 0;
+        for (int i = 0; i < 4; ++i) {
+            int digit = hexValue(text[pos++]);
+            if (digit < 0) return false;
+            out = (out << 4) | static_cast<unsigned>(digit);
         }
+        return true;
+    }
 
-        // 3. Load Reviews
-        for (const auto& raw_obj : parseArray(readAll(REVIEWS_FILE))) {
-            try {
-                int uid = stoi(extractJsonValue(raw_obj, "user_id"));
-                int pid = stoi(extractJsonValue(raw_obj, "product_id"));
-                int rating = stoi(extractJsonValue(raw_obj, "rating"));
-                reviews.emplace_back(uid, pid, rating, extractJsonValue(raw_obj, "comment"));
-                data_loaded = true;
-            } catch (...) {}
-        }
-        
-        // If no persistent data was found, create the default set and save it
-        if (!data_loaded) {
-            createDefaultData();
-            saveData(); 
+    static void appendUtf8(string& out, unsigned cp) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
         }
     }
 
-    /** Writes all in-memory data back to JSON files. */
-    void saveData() const {
-        // Helper to write a vector of JSON objects to a file
-        auto writeVector = [](const string& filename, const auto& vec) {
-            ofstream ofs(filename);
-            if (ofs.is_open()) {
-                ofs << "[" << endl;
-                for (size_t i = 0; i < vec.size(); ++i) {
-                    ofs << vec[i].toJson();
-                    if (i < vec.size() - 1) ofs << ",";
-                    ofs << endl;
-                }
-                ofs << "]";
-            } else {
-                 cerr << "DEBUG C++: FAILED to write file: " << filename << endl;
-            }
-        };
+    /** Parses the string starting at pos (the opening quote) and appends its decoded text to out. */
+    bool parseString(string& out) {
+        if (!consume('"')) return false;
+        while (pos < text.size()) {
+            // Copy the run up to the next quote or escape in one go
+            size_t end = text.find_first_of("\"\\", pos);
+            if (end == string_view::npos) break;
+            out.append(text.data() + pos, end - pos);
+            pos = end + 1;
+            if (text[end] == '"') return true;
 
-        writeVector(PRODUCTS_FILE, products);
-        writeVector(USERS_FILE, users);
-        writeVector(REVIEWS_FILE, reviews);
-    }
-    
-    // Helper to calculate the average rating for a product
-    double calculateAverageRating(int productId) const {
-        int sum = 0;
-        int count = 0;
-        for (const auto& review : reviews) {
-            if (review.getProductId() == productId) {
-                sum += review.getRating();
-                count++;
+            if (pos >= text.size()) break;
+            char e = text[pos++];
+            switch (e) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    unsigned cp;
+                    if (!readHex4(cp)) return false;
+                    // Combine a UTF-16 surrogate pair into one code point
+                    if (cp >= 0xD800 && cp <= 0xDBFF && pos + 1 < text.size() && text[pos] == '\\' && text[pos + 1] == 'u') {
+                        size_t save = pos;
+                        pos += 2;
+                        unsigned low;
+                        if (readHex4(low) && low >= 0xDC00 && low <= 0xDFFF) {
+                            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        } else {
+                            pos = save;
+                        }
+                    }
+                    appendUtf8(out, cp);
+                    break;
+                }
+                default: return false;
             }
         }
-        return count > 0 ? static_cast<double>(sum) / count : 0.0;
+        return false;
     }
 
-    // Helper functions (Finders)
-    const Product* findProductById(int productId) const {
-        for (const auto& product : products) {
-            if (product.getId() == productId) return &product;
-        }
-        return nullptr;
+    /** Returns the raw token of a number/true/false/null literal. */
+    string_view scanLiteral() {
+        skipWhitespace();
+        size_t start = pos;
+        while (pos < text.size() && (isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '-' || text[pos] == '+' || text[pos] == '.')) pos++;
+        return text.substr(start, pos - start);
     }
-    const User* findUserById(int userId) const {
-        for (const auto& user : users) {
-            if (user.getId() == userId) return &user;
+
+    /** Numeric text of the next value: a number literal or the contents of a string. */
+    bool scanNumericValue(string_view& token, string& scratch) {
+        skipWhitespace();
+        if (pos < text.size() && text[pos] == '"') {
+            scratch.clear();
+            if (!parseString(scratch)) { fail(); return false; }
+            token = scratch;
+            while (!token.empty() && isspace(static_cast<unsigned char>(token.front()))) token.remove_prefix(1);
+        } else {
+            token = scanLiteral();
+            if (token.empty()) { fail(); return false; }
         }
-        return nullptr;
+        return true;
     }
-    
-    // Helper to check if a user has reviewed a product
-    bool hasUserReviewed(int userId, int productId) const {
-        for (const auto& review : reviews) {
-            if (review.getUserId() == userId && review.getProductId() == productId) {
-                return true;
-            }
-        }
-        return false;
+
+public:
+    explicit JsonReader(string_view text) : text(text) {}
+
+    bool ok() const { return !failed; }
+    size_t errorOffset() const { return errorAt; }
+
+    /** True when only whitespace is left. */
+    bool atEnd() { skipWhitespace(); return pos >= text.size(); }
+
+    /** Calls onElement(reader) for each element; the callback must consume exactly one value. */
+    template <typename OnElement>
+    void readArray(OnElement&& onElement) {
+        if (!consume('[')) { fail(); return; }
+        if (consume(']')) return;
+        do {
+            onElement(*this);
+            if (failed) return;
+        } while (consume(','));
+        if (!consume(']')) fail();
     }
 
-    // Helper to get all product IDs reviewed by a user
-    vector<int> getReviewedProductIds(int userId) const {
-        vector<int> reviewed_ids;
-        for (const auto& review : reviews) {
-            if (review.getUserId() == userId) {
-                reviewed_ids.push_back(review.getProductId());
+    /** Calls onField(key, reader) for each member; the callback must consume exactly one value. */
+    template <typename OnField>
+    void readObject(OnField&& onField) {
+        if (!consume('{')) { fail(); return; }
+        if (consume('}')) return;
+        do {
+            skipWhitespace();
+            string_view key;
+            size_t start = pos + 1;
+            size_t end = text.find_first_of("\"\\", start);
+            if (pos < text.size() && text[pos] == '"' && end != string_view::npos && text[end] == '"') {
+                key = text.substr(start, end - start); // Plain key: view straight into the buffer
+                pos = end + 1;
+            } else {
+                keyBuffer.clear();
+                if (!parseString(keyBuffer)) { fail(); return; }
+                key = keyBuffer;
             }
+            if (!consume(':')) { fail(); return; }
+            onField(key, *this);
+            if (failed) return;
+        } while (consume(','));
+        if (!consume('}')) fail();
+    }
+
+    /** Reads a string value into out. Returns false (value skipped) if it is not a string. */
+    bool readString(string& out) {
+        skipWhitespace();
+        if (pos >= text.size() || text[pos] != '"') { skipValue(); return false; }
+        out.clear();
+        if (!parseString(out)) { fail(); return false; }
+        return true;
+    }
+
+    /**
+     * Reads a string value without copying when it has no escapes: the result then
+     * borrows from the input buffer, which must outlive it. Escaped text is decoded
+     * into an owned string. Returns false (value skipped) if it is not a string.
+     */
+    bool readText(TextRef& out) {
+        skipWhitespace();
+        if (pos >= text.size() || text[pos] != '"') { skipValue(); return false; }
+        size_t end = text.find_first_of("\"\\", pos + 1);
+        if (end != string_view::npos && text[end] == '"') {
+            out = TextRef::borrow(text.substr(pos + 1, end - pos - 1));
+            pos = end + 1;
+            return true;
         }
-        return reviewed_ids;
+        string decoded;
+        if (!parseString(decoded)) { fail(); return false; }
+        out = TextRef(move(decoded));
+        return true;
     }
 
-public:
-    // Constructor (Default)
-    RecommendationSystem() {}
+    /** Reads an integer given as a number or numeric string (leading digits, like stoi). */
+    bool readInt(int& out) {
+        string scratch;
+        string_view token;
+        if (!scanNumericValue(token, scratch)) return false;
+        if (!token.empty() && token.front() == '+') token.remove_prefix(1);
+        auto result = from_chars(token.data(), token.data() + token.size(), out);
+        return result.ec == errc() && result.ptr != token.data();
+    }
 
-    // --- JSON Getters (Read Operations) ---
+    /** Reads a floating point value given as a number or numeric string (leading part, like stod). */
+    bool readDouble(double& out) {
+        string scratch;
+        string_view token;
+        if (!scanNumericValue(token, scratch)) return false;
+        if (!token.empty() && token.front() == '+') token.remove_prefix(1);
+        auto result = from_chars(token.data(), token.data() + token.size(), out);
+        return result.ec == errc() && result.ptr != token.data();
+    }
 
-    string getProductsJson() {
-        loadData(); // Load latest state before generating output
-        ostringstream oss;
-        oss << "{\"products\":[";
-        for (size_t i = 0; i < products.size(); ++i) {
-            const auto& p = products[i];
-            
-            string product_json_base = p.toJson();
-            product_json_base.pop_back(); 
-            
-            oss << product_json_base; 
-            oss << ", \"avg_rating\":" << fixed << setprecision(2) << calculateAverageRating(p.getId());
-            oss << ", \"reviews_count\":" << count_if(reviews.begin(), reviews.end(), 
-                                      [&p](const Review& r){ return r.getProductId() == p.getId(); });
-            oss << "}";
-
-            if (i < products.size() - 1) oss << ",";
-        }
-        oss << "]}";
-        return oss.str();
-    }
-
-    string getUsersJson() {
-        loadData(); // Load latest state before generating output
-        ostringstream oss;
-        oss << "{\"users\":[";
-        for (size_t i = 0; i < users.size(); ++i) {
-            oss << users[i].toJson();
-            if (i < users.size() - 1) oss << ",";
-        }
-        oss << "]}";
-        return oss.str();
-    }
-
-    string getReviewsJson(int productId) {
-        loadData();
-        ostringstream oss;
-        oss << "{\"product_id\":" << productId << ", \"reviews\":[";
-        bool first = true;
-        for (const auto& review : reviews) {
-            if (review.getProductId() == productId) {
-                if (!first) oss << ",";
-                oss << review.toJson();
-                first = false;
+    /** Skips over any value, including nested objects and arrays. */
+    void skipValue() {
+        skipWhitespace();
+        if (pos >= text.size()) { fail(); return; }
+        char c = text[pos];
+        if (c == '{') {
+            readObject([](string_view, JsonReader& r) { r.skipValue(); });
+        } else if (c == '[') {
+            readArray([](JsonReader& r) { r.skipValue(); });
+        } else if (c == '"') {
+            keyBuffer.clear();
+            if (!parseString(keyBuffer)) fail();
+        } else if (scanLiteral().empty()) {
+            fail();
+        }
+    }
+};
+
+/**
+ * Splits one --serve input line into arguments, shell style.
+ * Words are separated by whitespace; '...' is taken literally and "..." accepts
+ * the escapes \" \\ \n \r \t so clients can send any argument on a single line.
+ */
+vector<string> splitCommandLine(const string& line) {
+    vector<string> args;
+    string current;
+    bool inWord = false;
+
+    for (size_t i = 0; i < line.length(); ++i) {
+        char c = line[i];
+        if (c == '\'') {
+            size_t end = line.find('\'', i + 1);
+            if (end == string::npos) throw invalid_argument("unterminated single quote");
+            current.append(line, i + 1, end - i - 1);
+            i = end;
+            inWord = true;
+        } else if (c == '"') {
+            for (++i; i < line.length() && line[i] != '"'; ++i) {
+                if (line[i] == '\\' && i + 1 < line.length()) {
+                    char e = line[++i];
+                    switch (e) {
+                        case 'n': current += '\n'; break;
+                        case 'r': current += '\r'; break;
+                        case 't': current += '\t'; break;
+                        default: current += e;
+                    }
+                } else {
+                    current += line[i];
+                }
             }
+            if (i >= line.length()) throw invalid_argument("unterminated double quote");
+            inWord = true;
+        } else if (isspace(static_cast<unsigned char>(c))) {
+            if (inWord) { args.push_back(current); current.clear(); inWord = false; }
+        } else {
+            current += c;
+            inWord = true;
         }
-        oss << "]}";
-        return oss.str();
     }
+    if (inWord) args.push_back(current);
+    return args;
+}
 
-    // --- JSON Adders (Create/Update Operations) ---
+/**
+ * Size and modification time of a file; a cached copy is stale when these differ.
+ */
+struct FileStamp {
+    bool exists = false;
+    uintmax_t size = 0;
+    filesystem::file_time_type mtime{};
 
-    string addUser(const string& name) {
-        loadData(); 
-        
-        int newId = nextUserId++;
-        users.emplace_back(newId, name);
-        saveData(); // Save changes
-        
-        return "{\"status\":\"success\", \"message\":\"User added successfully.\", \"id\":" + to_string(newId) + ", \"name\":\"" + escapeJsonString(name) + "\"}";
+    bool operator==(const FileStamp& other) const {
+        return exists == other.exists && size == other.size && mtime == other.mtime;
     }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
 
-    string addProduct(const string& name, const string& category, double price) {
-        loadData();
+FileStamp statFile(const string& filename) {
+    FileStamp stamp;
+    error_code ec;
+    stamp.size = filesystem::file_size(filename, ec);
+    if (ec) return FileStamp();
+    stamp.mtime = filesystem::last_write_time(filename, ec);
+    if (ec) return FileStamp();
+    stamp.exists = true;
+    return stamp;
+}
 
-        int newId = nextProductId++;
-        products.emplace_back(newId, name, category, price);
-        saveData();
+/**
+ * Read-only memory mapping of a whole file. The loaders parse straight from
+ * the mapped pages, and the text fields of loaded records point into them.
+ * Writers replace data files by renaming a new file over them, so a live
+ * mapping keeps seeing the old contents until the owner reloads and remaps.
+ * Windows refuses to replace a file that any process has mapped, so there
+ * (and whenever mmap fails) the file is read into an owned buffer instead.
+ */
+class MappedFile {
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    string buffer; // Contents when the file is read instead of mapped
 
-        return "{\"status\":\"success\", \"message\":\"Product added successfully.\", \"id\":" + to_string(newId) + "}";
-    }
-    
-    string purchaseProduct(int userId, int productId) {
-        loadData();
-        
-        if (findUserById(userId) == nullptr) return "{\"status\":\"error\", \"message\":\"User not found.\"}";
-        if (findProductById(productId) == nullptr) return "{\"status\":\"error\", \"message\":\"Product not found.\"}";
-        
-        // NOTE: In the persistent model, 'purchase' is just a status update and is handled 
-        // by the C++ engine confirming the items exist.
-        
-        return "{\"status\":\"success\", \"message\":\"Purchase recorded (no dedicated purchase history storage in this C++ version).\"}";
+    void close() {
+#ifndef _WIN32
+        if (mapped) munmap(const_cast<char*>(data), length);
+#endif
+        data = nullptr;
+        length = 0;
+        mapped = false;
+        buffer.clear();
     }
 
-    string rateProduct(int userId, int productId, int rating) {
-        // Redirects to addReview as it's the persistent way to track ratings
-        return addReview(userId, productId, rating, "No comment provided.");
+    bool readIntoBuffer(const string& filename) {
+        ifstream ifs(filename, ios::binary);
+        if (!ifs.is_open()) return false;
+        buffer.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+        return true;
     }
 
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    string addReview(int userId, int productId, int rating, const string& comment) {
-        loadData();
+    /** Maps the file, replacing any previous mapping. Returns false if it cannot be opened. */
+    bool open(const string& filename) {
+        close();
+#ifdef _WIN32
+        return readIntoBuffer(filename);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0) { ::close(fd); return readIntoBuffer(filename); }
+        if (info.st_size == 0) { ::close(fd); return true; }
+        void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // The mapping stays valid without the descriptor
+        if (view == MAP_FAILED) return readIntoBuffer(filename);
+        data = static_cast<const char*>(view);
+        length = static_cast<size_t>(info.st_size);
+        mapped = true;
+        return true;
+#endif
+    }
 
-        if (findUserById(userId) == nullptr) return "{\"status\":\"error\", \"message\":\"User not found.\"}";
-        if (findProductById(productId) == nullptr) return "{\"status\":\"error\", \"message\":\"Product not found.\"}";
-        if (rating < 1 || rating > 5) return "{\"status\":\"error\", \"message\":\"Invalid rating (1-5).\"}";
-        
-        if (hasUserReviewed(userId, productId)) return "{\"status\":\"error\", \"message\":\"User has already reviewed this product.\"}";
+    string_view view() const { return string_view(data, length); }
+};
 
+// --- Thread Pool ---
 
-        reviews.emplace_back(userId, productId, rating, comment);
-        saveData();
+/**
+ * Fixed set of worker threads for the bulk rebuilds. parallelFor() cuts a range
+ * into chunks that the workers and the calling thread claim one at a time from
+ * a shared counter, so threads that finish early take over the remaining work.
+ * Workers are started on first use; parallel regions from different callers run
+ * one after another.
+ */
+class ThreadPool {
+private:
+    size_t threadCount = 1;
+    vector<thread> workers;
+    mutex regionLock; // Serializes parallel regions
+    mutex lock;
+    condition_variable wake, finished;
 
-        return "{\"status\":\"success\", \"message\":\"Review added.\", \"product_id\":" + to_string(productId) + ", \"new_avg_rating\":" + to_string(calculateAverageRating(productId)) + "}";
-    }
+    // The region being run, published under `lock`
+    const function<void(size_t, size_t)>* job = nullptr;
+    size_t jobCount = 0;
+    size_t jobGrain = 1;
+    unsigned long long jobId = 0;
+    atomic<size_t> nextBegin{0};
+    size_t busy = 0;
+    bool stopping = false;
+    exception_ptr failure; // The first exception a chunk threw, rethrown by parallelFor
 
-    string deleteUser(int userId) {
-        loadData();
-        
-        // Find and remove the user
-        auto it = find_if(users.begin(), users.end(), 
-            [userId](const User& u) { return u.getId() == userId; });
-        
-        if (it == users.end()) {
-            return "{\"status\":\"error\", \"message\":\"User not found.\"}";
+    void runChunks() {
+        for (;;) {
+            size_t begin = nextBegin.fetch_add(jobGrain);
+            if (begin >= jobCount) return;
+            try {
+                (*job)(begin, min(jobCount, begin + jobGrain));
+            } catch (...) {
+                lock_guard<mutex> guard(lock);
+                if (!failure) failure = current_exception();
+                nextBegin = jobCount; // The chunks not started yet are skipped
+            }
         }
-        
-        users.erase(it);
-        
-        // Also remove all reviews by this user
-        reviews.erase(
-            remove_if(reviews.begin(), reviews.end(),
-                [userId](const Review& r) { return r.getUserId() == userId; }),
-            reviews.end()
-        );
-        
-        saveData();
-        return "{\"status\":\"success\", \"message\":\"User deleted successfully.\", \"id\":" + to_string(userId) + "}";
     }
 
-    string deleteProduct(int productId) {
-        loadData();
-        
-        // Find and remove the product
-        auto it = find_if(products.begin(), products.end(), 
-            [productId](const Product& p) { return p.getId() == productId; });
-        
-        if (it == products.end()) {
-            return "{\"status\":\"error\", \"message\":\"Product not found.\"}";
+    void workerLoop() {
+        unsigned long long seen = 0;
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [&]() { return stopping || jobId != seen; });
+            if (stopping) return;
+            seen = jobId;
+            guard.unlock();
+            runChunks();
+            guard.lock();
+            if (--busy == 0) finished.notify_all();
         }
-        
-        products.erase(it);
-        
-        // Also remove all reviews for this product
-        reviews.erase(
-            remove_if(reviews.begin(), reviews.end(),
-                [productId](const Review& r) { return r.getProductId() == productId; }),
-            reviews.end()
-        );
-        
-        saveData();
-        return "{\"status\":\"success\", \"message\":\"Product deleted successfully.\", \"id\":" + to_string(productId) + "}";
     }
-    
-    string getRecommendationsJson(int userId) {
-        loadData();
-        
-        const User* user = findUserById(userId);
-        if (!user) { return "{\"status\":\"error\", \"message\":\"User not found.\"}"; }
 
-        // 1. Find the category of the last reviewed product
-        const vector<int> reviewedIds = getReviewedProductIds(userId);
-        if (reviewedIds.empty()) { 
-            return "{\"status\":\"error\", \"message\":\"User has no review history for recommendations.\"}";
+    void stop() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
         }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+        stopping = false;
+    }
 
-        int lastReviewedId = reviewedIds.back();
-        const Product* lastProduct = findProductById(lastReviewedId);
-        if (!lastProduct) { return "{\"status\":\"error\", \"message\":\"Internal data error: Last reviewed product missing.\"}"; }
+public:
+    explicit ThreadPool(size_t threads = 0) { setThreadCount(threads); }
+    ~ThreadPool() { stop(); }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
 
-        const string& targetCategory = lastProduct->getCategory();
+    /** Threads used per region, the caller included; 0 means one per hardware thread. */
+    void setThreadCount(size_t threads) {
+        lock_guard<mutex> region(regionLock);
+        stop();
+        threadCount = threads > 0 ? threads : max<size_t>(1, thread::hardware_concurrency());
+    }
+    size_t size() const { return threadCount; }
 
-        // 2. Filter and collect relevant products (same category, not reviewed)
-        vector<pair<double, const Product*>> candidates; // pair of (rating, product*)
-        for (const auto& product : products) {
-            // Must match category AND not be already reviewed by the user
-            if (product.getCategory() == targetCategory && !hasUserReviewed(userId, product.getId())) {
-                candidates.push_back({calculateAverageRating(product.getId()), &product});
-            }
+    /**
+     * Runs work(begin, end) over [0, count) in chunks of `grain` items and waits for
+     * all of them. If a chunk throws, the rest are skipped and the exception is
+     * rethrown here once the running ones are done.
+     */
+    template <typename Work>
+    void parallelFor(size_t count, size_t grain, Work&& work) {
+        grain = max<size_t>(1, grain);
+        if (count == 0) return;
+        if (threadCount == 1 || count <= grain) {
+            work(size_t(0), count);
+            return;
         }
 
-        if (candidates.empty()) {
-             return "{\"status\":\"success\", \"user_id\":" + to_string(userId) + ", \"recommendations\":[], \"message\":\"No new recommendations available in category " + targetCategory + ".\"}";
+        lock_guard<mutex> region(regionLock);
+        if (workers.empty()) {
+            for (size_t i = 1; i < threadCount; ++i) workers.emplace_back([this]() { workerLoop(); });
         }
+        const function<void(size_t, size_t)> task = [&work](size_t begin, size_t end) { work(begin, end); };
+        {
+            lock_guard<mutex> guard(lock);
+            job = &task;
+            jobCount = count;
+            jobGrain = grain;
+            nextBegin = 0;
+            busy = workers.size();
+            jobId++;
+        }
+        wake.notify_all();
+        runChunks();
 
-        // 3. Sort candidates by average rating (descending)
-        sort(candidates.begin(), candidates.end(), [](const pair<double, const Product*>& a, const pair<double, const Product*>& b) {
-            return a.first > b.first;
-        });
+        unique_lock<mutex> guard(lock);
+        finished.wait(guard, [&]() { return busy == 0; });
+        job = nullptr;
+        exception_ptr thrown = failure;
+        failure = nullptr;
+        if (thrown) rethrow_exception(thrown);
+    }
+
+    /** parallelFor() with about eight chunks per thread, for items of similar cost. */
+    template <typename Work>
+    void parallelFor(size_t count, Work&& work) {
+        parallelFor(count, count / (threadCount * 8) + 1, forward<Work>(work));
+    }
+};
+
+// --- Metrics ---
+// Counters for the hot paths, reported by --stats in Prometheus text format.
+// Each thread adds to its own shard without synchronisation beyond relaxed atomics;
+// a scrape merges the live shards with the totals of threads that have exited.
+
+enum Metric : size_t {
+    LOADS_PRODUCTS, LOADS_USERS, LOADS_REVIEWS,
+    LOAD_NS_PRODUCTS, LOAD_NS_USERS, LOAD_NS_REVIEWS,
+    LOAD_BYTES_PRODUCTS, LOAD_BYTES_USERS, LOAD_BYTES_REVIEWS,
+    LOG_REPLAYED_RECORDS, LOG_REPLAY_NS,
+    SAVES, SAVE_BYTES, SAVE_NS,
+    LOG_APPENDS, LOG_APPEND_BYTES, LOG_APPEND_NS,
+    RECOMMENDATIONS_CATEGORY, RECOMMENDATIONS_ITEMCF,
+    RECOMMENDATION_NS_CATEGORY, RECOMMENDATION_NS_ITEMCF,
+    CANDIDATES_CATEGORY, CANDIDATES_ITEMCF,
+    SIMILARITY_ROWS_BUILT, SIMILARITY_BUILD_NS,
+    RECOMMENDATION_CACHE_HITS, RECOMMENDATION_CACHE_MISSES, RECOMMENDATION_CACHE_EVICTIONS,
+    RECOMMENDATION_CACHE_INVALIDATIONS_USER, RECOMMENDATION_CACHE_INVALIDATIONS_CATEGORY,
+    METRIC_COUNT
+};
+
+/** How a metric is printed; values of *_NS metrics are nanoseconds, printed as seconds. */
+struct MetricInfo {
+    const char* family;
+    const char* labels;
+    const char* help;
+    bool nanoseconds;
+};
+
+// In Metric order; series of one family are adjacent
+const MetricInfo METRIC_INFO[METRIC_COUNT] = {
+    {"recsys_file_loads_total", "{file=\"products\"}", "Data files parsed.", false},
+    {"recsys_file_loads_total", "{file=\"users\"}", "Data files parsed.", false},
+    {"recsys_file_loads_total", "{file=\"reviews\"}", "Data files parsed.", false},
+    {"recsys_file_load_seconds_total", "{file=\"products\"}", "Time spent parsing and indexing data files.", true},
+    {"recsys_file_load_seconds_total", "{file=\"users\"}", "Time spent parsing and indexing data files.", true},
+    {"recsys_file_load_seconds_total", "{file=\"reviews\"}", "Time spent parsing and indexing data files.", true},
+    {"recsys_file_load_bytes_total", "{file=\"products\"}", "Bytes of data files parsed.", false},
+    {"recsys_file_load_bytes_total", "{file=\"users\"}", "Bytes of data files parsed.", false},
+    {"recsys_file_load_bytes_total", "{file=\"reviews\"}", "Bytes of data files parsed.", false},
+    {"recsys_log_replayed_records_total", "", "Mutation log records replayed on load.", false},
+    {"recsys_log_replay_seconds_total", "", "Time spent replaying the mutation log.", true},
+    {"recsys_saves_total", "", "Full rewrites of the data files.", false},
+    {"recsys_save_bytes_total", "", "Bytes written by full rewrites of the data files.", false},
+    {"recsys_save_seconds_total", "", "Time spent writing and syncing the data files.", true},
+    {"recsys_log_appends_total", "", "Durable appends to the mutation log.", false},
+    {"recsys_log_append_bytes_total", "", "Bytes appended to the mutation log.", false},
+    {"recsys_log_append_seconds_total", "", "Time spent appending to and syncing the mutation log.", true},
+    {"recsys_recommendations_total", "{strategy=\"category\"}", "Recommendation requests answered.", false},
+    {"recsys_recommendations_total", "{strategy=\"itemcf\"}", "Recommendation requests answered.", false},
+    {"recsys_recommendation_seconds_total", "{strategy=\"category\"}", "Time spent computing recommendations.", true},
+    {"recsys_recommendation_seconds_total", "{strategy=\"itemcf\"}", "Time spent computing recommendations.", true},
+    {"recsys_recommendation_candidates_total", "{strategy=\"category\"}", "Candidate products considered for recommendations.", false},
+    {"recsys_recommendation_candidates_total", "{strategy=\"itemcf\"}", "Candidate products considered for recommendations.", false},
+    {"recsys_similarity_rows_built_total", "", "Item-item similarity rows computed.", false},
+    {"recsys_similarity_build_seconds_total", "", "Time spent computing similarity rows.", true},
+    {"recsys_recommendation_cache_hits_total", "", "Category recommendations answered from the cache.", false},
+    {"recsys_recommendation_cache_misses_total", "", "Category recommendations computed because no valid entry was cached.", false},
+    {"recsys_recommendation_cache_evictions_total", "", "Cached recommendations dropped to stay within the memory budget.", false},
+    {"recsys_recommendation_cache_invalidations_total", "{scope=\"user\"}", "Cache invalidations by changes to a user or a category.", false},
+    {"recsys_recommendation_cache_invalidations_total", "{scope=\"category\"}", "Cache invalidations by changes to a user or a category.", false},
+};
+
+class Metrics {
+private:
+    using Values = array<uint64_t, METRIC_COUNT>;
+    struct Shard {
+        array<atomic<uint64_t>, METRIC_COUNT> values{};
+    };
+
+    // A thread's shard, registered on its first add and folded into `retired` when it exits
+    struct LocalShard {
+        Shard shard;
+        LocalShard() {
+            lock_guard<mutex> guard(lock);
+            live.push_back(&shard);
+        }
+        ~LocalShard() {
+            lock_guard<mutex> guard(lock);
+            for (size_t i = 0; i < METRIC_COUNT; ++i) retired[i] += shard.values[i].load(memory_order_relaxed);
+            live.erase(find(live.begin(), live.end(), &shard));
+        }
+    };
+
+    inline static mutex lock;
+    inline static vector<Shard*> live;
+    inline static Values retired{};
+
+    static Shard& local() {
+        thread_local LocalShard shard;
+        return shard.shard;
+    }
+
+public:
+    /** Adds to a counter. Only the calling thread writes its shard, so no read-modify-write is needed. */
+    static void add(Metric metric, uint64_t amount = 1) {
+        atomic<uint64_t>& value = local().values[metric];
+        value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    /** Current totals over all threads. */
+    static Values totals() {
+        lock_guard<mutex> guard(lock);
+        Values sum = retired;
+        for (const Shard* shard : live) {
+            for (size_t i = 0; i < METRIC_COUNT; ++i) sum[i] += shard->values[i].load(memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    /** Appends the counters to `out` as Prometheus text exposition. */
+    static void writePrometheus(JsonWriter& out) {
+        Values sum = totals();
+        const char* family = "";
+        for (size_t i = 0; i < METRIC_COUNT; ++i) {
+            const MetricInfo& info = METRIC_INFO[i];
+            if (strcmp(info.family, family) != 0) {
+                family = info.family;
+                out.raw("# HELP ").raw(family).raw(' ').raw(info.help).raw('\n');
+                out.raw("# TYPE ").raw(family).raw(" counter\n");
+            }
+            out.raw(family).raw(info.labels).raw(' ');
+            if (info.nanoseconds) out.fixed(sum[i] / 1e9, 9);
+            else out.number(sum[i]);
+            out.raw('\n');
+        }
+    }
+};
+
+/** Adds the time from construction to destruction to a *_NS metric. */
+class MetricTimer {
+private:
+    Metric metric;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+public:
+    explicit MetricTimer(Metric metric) : metric(metric) {}
+    ~MetricTimer() {
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started);
+        Metrics::add(metric, static_cast<uint64_t>(elapsed.count()));
+    }
+};
+
+/** The sizes of the in-memory data, reported by --stats as gauges. */
+struct DataSizes {
+    size_t products = 0, users = 0, reviews = 0, purchases = 0, logRecords = 0, similarityRows = 0;
+    size_t cachedRecommendations = 0, cacheBytes = 0;
+};
+
+void writeDataSizeGauges(JsonWriter& out, const DataSizes& sizes) {
+    auto gauge = [&out](const char* name, const char* help, size_t value) {
+        out.raw("# HELP ").raw(name).raw(' ').raw(help).raw('\n');
+        out.raw("# TYPE ").raw(name).raw(" gauge\n");
+        out.raw(name).raw(' ').number(value).raw('\n');
+    };
+    gauge("recsys_products", "Products in memory.", sizes.products);
+    gauge("recsys_users", "Users in memory.", sizes.users);
+    gauge("recsys_reviews", "Reviews in memory.", sizes.reviews);
+    gauge("recsys_purchases", "Distinct (user, product) purchases in memory.", sizes.purchases);
+    gauge("recsys_log_records", "Records in the mutation log since the last compaction.", sizes.logRecords);
+    gauge("recsys_similarity_rows", "Products with a cached similarity row.", sizes.similarityRows);
+    gauge("recsys_recommendation_cache_entries", "Users with a cached recommendation reply.", sizes.cachedRecommendations);
+    gauge("recsys_recommendation_cache_bytes", "Memory charged to the recommendation cache.", sizes.cacheBytes);
+}
+
+// --- Durable File Writes ---
+
+/** Flushes a C stream and asks the OS to put its data on disk. */
+bool flushToDisk(FILE* file) {
+    if (fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+/** Makes a rename inside the file's directory durable (a no-op on Windows). */
+void syncParentDirectory(const string& filename) {
+#ifndef _WIN32
+    string dir = filesystem::path(filename).parent_path().string();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+#else
+    (void)filename;
+#endif
+}
+
+/**
+ * First half of a crash-safe replace: write(FILE*) fills filename + ".tmp",
+ * which is then fsynced. Returns false (and removes the temp file) on failure.
+ */
+template <typename Writer>
+bool writeTempFile(const string& filename, Writer&& write) {
+    const string tempName = filename + ".tmp";
+    FILE* file = fopen(tempName.c_str(), "w");
+    if (!file) {
+        cerr << "DEBUG C++: FAILED to write file: " << filename << endl;
+        return false;
+    }
+    write(file);
+    bool ok = !ferror(file) && flushToDisk(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        cerr << "DEBUG C++: FAILED to write file: " << filename << endl;
+        error_code ec;
+        filesystem::remove(tempName, ec);
+    }
+    return ok;
+}
+
+bool writeTempFileContents(const string& filename, const string& contents) {
+    return writeTempFile(filename, [&contents](FILE* file) { fwrite(contents.data(), 1, contents.size(), file); });
+}
+
+/** Second half: renames the written temp file over the target (callers sync the directory). */
+bool replaceWithTempFile(const string& filename) {
+    const string tempName = filename + ".tmp";
+    error_code ec;
+    filesystem::rename(tempName, filename, ec);
+    if (ec) {
+        cerr << "DEBUG C++: FAILED to replace file: " << filename << " (" << ec.message() << ")" << endl;
+        filesystem::remove(tempName, ec);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Replaces a file crash-safely: write(FILE*) fills a temp file, which is
+ * fsynced and then renamed over the target. Readers (and a crash) see either
+ * the old or the new contents, never a partial file.
+ */
+template <typename Writer>
+bool writeFileAtomically(const string& filename, Writer&& write) {
+    if (!writeTempFile(filename, forward<Writer>(write)) || !replaceWithTempFile(filename)) return false;
+    syncParentDirectory(filename);
+    return true;
+}
+
+/**
+ * Appends one or more complete lines to a log file and fsyncs before returning.
+ * If the file does not end in a newline (a write torn by a crash), a newline is
+ * written first, so the partial record stays on a line of its own.
+ */
+bool appendDurably(const string& filename, const string& lines) {
+#ifdef _WIN32
+    int fd = _open(filename.c_str(), _O_RDWR | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+#endif
+    if (fd < 0) {
+        cerr << "DEBUG C++: FAILED to append to file: " << filename << endl;
+        return false;
+    }
+
+    string data;
+#ifdef _WIN32
+    long long size = _lseeki64(fd, 0, SEEK_END);
+    char last = '\n';
+    if (size > 0 && _lseeki64(fd, size - 1, SEEK_SET) == size - 1) _read(fd, &last, 1);
+#else
+    struct stat info;
+    char last = '\n';
+    if (fstat(fd, &info) == 0 && info.st_size > 0) pread(fd, &last, 1, info.st_size - 1);
+#endif
+    if (last != '\n') data += '\n';
+    data += lines;
+
+    bool ok = true;
+    for (size_t written = 0; ok && written < data.size(); ) {
+#ifdef _WIN32
+        int n = _write(fd, data.data() + written, static_cast<unsigned>(data.size() - written));
+#else
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+#endif
+        if (n <= 0) ok = false; else written += static_cast<size_t>(n);
+    }
+#ifdef _WIN32
+    ok = _commit(fd) == 0 && ok;
+    _close(fd);
+#else
+    ok = fsync(fd) == 0 && ok;
+    ::close(fd);
+#endif
+    if (!ok) cerr << "DEBUG C++: FAILED to append to file: " << filename << endl;
+    return ok;
+}
+
+// --- Cross-Process Locking ---
+
+/**
+ * Advisory lock on LOCK_FILE (flock on POSIX, LockFileEx on Windows). Writers in
+ * any process hold it exclusively from the refresh before a change until the
+ * change is on disk, so no two processes pick the same new id or validate
+ * against stale data. Readers take it shared while loading, so they never mix
+ * files from before and after another process's compaction.
+ * The lock belongs to the open file, not the thread: callers in one process must
+ * serialize their use of it (RecommendationSystem does so with its writer mutex).
+ */
+class FileLock {
+private:
+    string filename;
+    int fd = -1;
+    bool warned = false;
+
+    bool openFile() {
+        if (fd >= 0) return true;
+#ifdef _WIN32
+        fd = _open(filename.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+#endif
+        if (fd < 0 && !warned) {
+            cerr << "DEBUG C++: Cannot open lock file " << filename << ", continuing without cross-process locking." << endl;
+            warned = true;
+        }
+        return fd >= 0;
+    }
+
+public:
+    explicit FileLock(string filename) : filename(move(filename)) {}
+    ~FileLock() {
+        if (fd < 0) return;
+#ifdef _WIN32
+        _close(fd);
+#else
+        ::close(fd);
+#endif
+    }
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    /** Takes the lock. With wait == false, returns false instead of blocking if it is held elsewhere. */
+    bool lock(bool exclusive, bool wait) {
+        if (!openFile()) return true; // No lock file (e.g. read-only directory): run unlocked
+#ifdef _WIN32
+        OVERLAPPED region{};
+        DWORD flags = (exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0) | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+        return LockFileEx(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), flags, 0, MAXDWORD, MAXDWORD, &region) != 0;
+#else
+        int operation = (exclusive ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB);
+        while (flock(fd, operation) != 0) {
+            if (errno != EINTR) return false;
+        }
+        return true;
+#endif
+    }
+
+    void unlock() {
+        if (fd < 0) return;
+#ifdef _WIN32
+        OVERLAPPED region{};
+        UnlockFileEx(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), 0, MAXDWORD, MAXDWORD, &region);
+#else
+        flock(fd, LOCK_UN);
+#endif
+    }
+};
+
+/** Holds a FileLock until destroyed (or moved from). */
+class FileLockGuard {
+private:
+    FileLock* held = nullptr;
+
+public:
+    FileLockGuard() = default;
+    FileLockGuard(FileLock& lock, bool exclusive, bool wait = true) {
+        if (lock.lock(exclusive, wait)) held = &lock;
+    }
+    FileLockGuard(FileLockGuard&& other) noexcept : held(other.held) { other.held = nullptr; }
+    FileLockGuard& operator=(FileLockGuard&& other) noexcept {
+        if (this != &other) {
+            if (held) held->unlock();
+            held = other.held;
+            other.held = nullptr;
+        }
+        return *this;
+    }
+    ~FileLockGuard() {
+        if (held) held->unlock();
+    }
+
+    bool owns() const { return held != nullptr; }
+};
+
+// --- Binary Snapshots ---
+// Layout: SnapshotHeader, then fixed-width columns (each padded to 8 bytes), then
+// one string table. Strings are numbered in the order product names, category
+// names, user names, review comments; a uint64 column holds the end offset of
+// each, so string k is table[end[k-1], end[k]). Numbers are stored in native
+// byte order: a snapshot is a local startup cache, JSON stays the interchange format.
+
+const char SNAPSHOT_MAGIC[8] = {'R', 'E', 'C', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t SNAPSHOT_VERSION = 2; // 2: purchase columns
+static_assert(sizeof(int) == sizeof(int32_t), "snapshot id columns are written straight from int columns");
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+/** A FileStamp in fixed-width form. */
+struct SnapshotStamp {
+    uint64_t exists;
+    uint64_t size;
+    int64_t mtime;
+
+    static SnapshotStamp from(const FileStamp& stamp) {
+        return {stamp.exists ? 1u : 0u, static_cast<uint64_t>(stamp.size), static_cast<int64_t>(stamp.mtime.time_since_epoch().count())};
+    }
+    FileStamp toFileStamp() const {
+        FileStamp stamp;
+        stamp.exists = exists != 0;
+        stamp.size = static_cast<uintmax_t>(size);
+        stamp.mtime = filesystem::file_time_type(filesystem::file_time_type::duration(mtime));
+        return stamp;
+    }
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int32_t nextProductId;
+    int32_t nextUserId;
+    uint64_t productCount;
+    uint64_t categoryCount;
+    uint64_t userCount;
+    uint64_t reviewCount;
+    uint64_t purchaseCount;
+    uint64_t stringBytes;
+    // What the JSON files and the mutation log looked like when the snapshot was taken
+    SnapshotStamp productsStamp, usersStamp, reviewsStamp, purchasesStamp;
+    uint64_t logOffset;
+    int64_t logRecords;
+};
+
+/** Appends raw columns to an in-memory image of a snapshot file. */
+class SnapshotWriter {
+private:
+    string image;
+    string strings;
+    vector<uint64_t> stringEnds;
+
+    void pad() { image.append((8 - image.size() % 8) % 8, '\0'); }
+
+public:
+    template <typename T>
+    void column(const vector<T>& values) {
+        image.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+        pad();
+    }
+
+    void addString(string_view text) {
+        strings.append(text.data(), text.size());
+        stringEnds.push_back(strings.size());
+    }
+
+    /** Returns the finished file contents: header, columns, string ends, string table. */
+    string finish(SnapshotHeader header) {
+        header.stringBytes = strings.size();
+        column(stringEnds);
+        string out(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append((8 - out.size() % 8) % 8, '\0');
+        out += image;
+        out += strings;
+        return out;
+    }
+};
+
+/** Reads the columns of a snapshot image in the order SnapshotWriter wrote them. */
+class SnapshotReader {
+private:
+    string_view image;
+    size_t pos = 0;
+    bool failed = false;
+
+public:
+    SnapshotReader(string_view image) : image(image) {}
+
+    bool ok() const { return !failed; }
+
+    bool header(SnapshotHeader& out) {
+        if (image.size() < sizeof(out)) {
+            failed = true;
+            return false;
+        }
+        memcpy(&out, image.data(), sizeof(out));
+        pos = sizeof(out) + (8 - sizeof(out) % 8) % 8;
+        return true;
+    }
+
+    template <typename T>
+    bool column(vector<T>& out, uint64_t count) {
+        if (failed || count > (image.size() - min(pos, image.size())) / sizeof(T)) {
+            failed = true;
+            return false;
+        }
+        out.resize(static_cast<size_t>(count));
+        // An empty vector's data() may be null, which memcpy does not allow even for 0 bytes
+        if (!out.empty()) memcpy(out.data(), image.data() + pos, out.size() * sizeof(T));
+        pos += out.size() * sizeof(T);
+        pos += (8 - pos % 8) % 8;
+        return true;
+    }
+
+    /** The string table: everything after the last column, which must be `bytes` long. */
+    string_view rest(uint64_t bytes) {
+        if (failed || pos > image.size() || image.size() - pos != bytes) { failed = true; return {}; }
+        return image.substr(pos);
+    }
+};
+
+// --- 1. Review Class ---
+// A single review as a value, used to build and serialize records. The reviews
+// themselves are kept column by column in ReviewStore.
+class Review {
+private:
+    int user_id;
+    int product_id;
+    int rating; // 1-5
+    TextRef comment;
+
+public:
+    Review(int uid, int pid, int r, TextRef c) 
+        : user_id(uid), product_id(pid), rating(r), comment(move(c)) {}
+
+    // Getters
+    int getUserId() const { return user_id; }
+    int getProductId() const { return product_id; }
+    int getRating() const { return rating; }
+    string_view getComment() const { return comment.view(); }
+
+    // JSON serialization
+    void toJson(JsonWriter& out) const {
+        out.raw("{\"user_id\":").number(user_id)
+           .raw(",\"product_id\":").number(product_id)
+           .raw(",\"rating\":").number(rating)
+           .raw(",\"comment\":").quoted(comment.view())
+           .raw('}');
+    }
+};
+
+/**
+ * Compressed sparse row index from a key (a user or product id) to the
+ * positions of its reviews: key k owns positions[offsets[r], offsets[r + 1])
+ * for its row r, in storage order. Reviews appended after the build go to a
+ * per-key overflow list so adds stay O(1); the owner rebuilds once that list
+ * grows past a fraction of the index (see needsRebuild()).
+ */
+class ReviewAdjacency {
+private:
+    unordered_map<int, uint32_t> rows;
+    vector<int> keys; // keys[r] owns row r
+    vector<uint32_t> offsets{0};
+    vector<uint32_t> positions;
+    unordered_map<int, vector<uint32_t>> appended;
+    size_t appendedCount = 0;
+
+public:
+    /** Rebuilds the index over a whole key column with a counting sort. */
+    void build(const vector<int>& column) {
+        rows.clear();
+        keys.clear();
+        appended.clear();
+        appendedCount = 0;
+
+        vector<uint32_t> rowOf(column.size());
+        vector<uint32_t> counts;
+        for (size_t i = 0; i < column.size(); ++i) {
+            auto slot = rows.try_emplace(column[i], static_cast<uint32_t>(counts.size()));
+            if (slot.second) {
+                counts.push_back(0);
+                keys.push_back(column[i]);
+            }
+            counts[slot.first->second]++;
+            rowOf[i] = slot.first->second;
+        }
+
+        offsets.assign(counts.size() + 1, 0);
+        for (size_t r = 0; r < counts.size(); ++r) offsets[r + 1] = offsets[r] + counts[r];
+        positions.resize(column.size());
+        vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < column.size(); ++i) positions[fill[rowOf[i]]++] = static_cast<uint32_t>(i);
+    }
+
+    /** Keys that have a row in the last build, in first-seen order. */
+    const vector<int>& rowKeys() const { return keys; }
+
+    void append(int key, size_t position) {
+        appended[key].push_back(static_cast<uint32_t>(position));
+        appendedCount++;
+    }
+
+    bool needsRebuild() const { return appendedCount > max<size_t>(1024, positions.size() / 4); }
+
+    /** Calls visit(position) for each review of the key, in storage order. */
+    template <typename Visitor>
+    void forEach(int key, Visitor&& visit) const {
+        auto row = rows.find(key);
+        if (row != rows.end()) {
+            for (uint32_t i = offsets[row->second]; i < offsets[row->second + 1]; ++i) visit(static_cast<size_t>(positions[i]));
+        }
+        auto extra = appended.find(key);
+        if (extra != appended.end()) {
+            for (uint32_t position : extra->second) visit(static_cast<size_t>(position));
+        }
+    }
+
+    /** Position of the key's most recently stored review; false if it has none. */
+    bool last(int key, size_t& position) const {
+        auto extra = appended.find(key);
+        if (extra != appended.end() && !extra->second.empty()) {
+            position = extra->second.back();
+            return true;
+        }
+        auto row = rows.find(key);
+        if (row == rows.end()) return false;
+        position = positions[offsets[row->second + 1] - 1];
+        return true;
+    }
+};
+
+/**
+ * Column-oriented review storage: user ids, product ids and ratings live in
+ * separate contiguous arrays, so scans over them touch a few bytes per review
+ * instead of whole records. Comments are views kept out of the hot columns;
+ * they point into the mapped data file they were read from, or into an arena
+ * for text that had to be unescaped or was added at runtime. Short runtime
+ * comments repeat a lot ("No comment provided." from --rate), so those are
+ * interned and stored once. Arena space of removed reviews is only given back
+ * when the store is cleared (on reload).
+ *
+ * Removing a review only marks it (rating 0) in place, so a delete touches just
+ * the affected reviews and the indexes stay valid; lookups skip marked reviews.
+ * The marks are purged in one pass, which renumbers positions, when the owner
+ * calls purge() before writing the store out (saves, compactions, snapshots), so a
+ * delete never pays for a purge under the writer's lock.
+ */
+class ReviewStore {
+private:
+    static const size_t INTERNED_COMMENT_BYTES = 64;
+
+    vector<int> userIds;
+    vector<int> productIds;
+    vector<uint8_t> ratings; // 1-5, 0 for a removed review
+    vector<string_view> comments;
+    size_t removedCount = 0;
+    TextArena arena;
+    StringPool shortComments;
+
+    // user -> reviews and product -> reviews, built by buildIndexes() after a bulk load
+    ReviewAdjacency byUser;
+    ReviewAdjacency byProduct;
+    bool indexed = false;
+
+public:
+    /** Reviews stored and not removed. */
+    size_t size() const { return userIds.size() - removedCount; }
+    bool empty() const { return size() == 0; }
+
+    /** Positions in use, removed reviews included: valid positions are [0, slots()). */
+    size_t slots() const { return userIds.size(); }
+    size_t removed() const { return removedCount; }
+    bool isRemoved(size_t i) const { return ratings[i] == 0; }
+
+    void clear() {
+        userIds.clear();
+        productIds.clear();
+        ratings.clear();
+        comments.clear();
+        removedCount = 0;
+        arena.clear();
+        shortComments.clear();
+        indexed = false;
+    }
+
+    /** Builds the user and product adjacency indexes over everything stored so far. */
+    void buildIndexes(ThreadPool* pool = nullptr) {
+        auto build = [this](size_t begin, size_t end) {
+            for (size_t which = begin; which < end; ++which) {
+                if (which == 0) byUser.build(userIds); else byProduct.build(productIds);
+            }
+        };
+        if (pool) pool->parallelFor(2, 1, build); else build(0, 2);
+        indexed = true;
+    }
+
+    /** Products that have reviews, as of the last buildIndexes(). */
+    const vector<int>& indexedProducts() const { return byProduct.rowKeys(); }
+
+    void reserve(size_t n) {
+        userIds.reserve(n);
+        productIds.reserve(n);
+        ratings.reserve(n);
+        comments.reserve(n);
+    }
+
+    /** Appends a review; borrowed comment text is kept as is, owned text is interned or copied to the arena. */
+    void add(int userId, int productId, int rating, const TextRef& comment) {
+        userIds.push_back(userId);
+        productIds.push_back(productId);
+        ratings.push_back(static_cast<uint8_t>(rating));
+        if (!comment.borrowsText() && comment.view().size() <= INTERNED_COMMENT_BYTES) {
+            comments.push_back(shortComments.intern(comment.view()));
+        } else {
+            comments.push_back(storeText(arena, comment));
+        }
+        if (indexed) {
+            byUser.append(userId, slots() - 1);
+            byProduct.append(productId, slots() - 1);
+            if (byUser.needsRebuild() || byProduct.needsRebuild()) buildIndexes();
+        }
+    }
+
+    int userId(size_t i) const { return userIds[i]; }
+    int productId(size_t i) const { return productIds[i]; }
+    int rating(size_t i) const { return ratings[i]; }
+    string_view comment(size_t i) const { return comments[i]; }
+    Review row(size_t i) const { return Review(userIds[i], productIds[i], ratings[i], TextRef::borrow(comments[i])); }
+
+    // Whole columns, for scans and for writing snapshots (removed reviews included)
+    const vector<int>& userIdColumn() const { return userIds; }
+    const vector<int>& productIdColumn() const { return productIds; }
+    const vector<uint8_t>& ratingColumn() const { return ratings; }
+
+    /** Positions of the reviews written by a user, in storage order. O(degree) once indexed. */
+    vector<size_t> findByUser(int userId) const {
+        vector<size_t> positions;
+        forEachOfUser(userId, [&positions](size_t i) { positions.push_back(i); });
+        return positions;
+    }
+
+    /** Positions of the reviews of a product, in storage order. O(degree) once indexed. */
+    vector<size_t> findByProduct(int productId) const {
+        vector<size_t> positions;
+        forEachOfProduct(productId, [&positions](size_t i) { positions.push_back(i); });
+        return positions;
+    }
+
+    /** Calls visit(position) for each review of a product, in storage order. */
+    template <typename Visitor>
+    void forEachOfProduct(int productId, Visitor&& visit) const {
+        forEachIn(byProduct, productIds, productId, visit);
+    }
+
+    /** Calls visit(position) for each review written by a user, in storage order. */
+    template <typename Visitor>
+    void forEachOfUser(int userId, Visitor&& visit) const {
+        forEachIn(byUser, userIds, userId, visit);
+    }
+
+    /** Position of the user's most recent review; false if the user has none. */
+    bool lastByUser(int userId, size_t& position) const {
+        if (indexed && byUser.last(userId, position) && !isRemoved(position)) return true;
+        bool found = false;
+        forEachOfUser(userId, [&](size_t i) { position = i; found = true; });
+        return found;
+    }
+
+    /** Marks the reviews at the given positions removed; positions stay valid until purge(). */
+    void removeAt(const vector<size_t>& positions) {
+        for (size_t i : positions) {
+            if (isRemoved(i)) continue;
+            ratings[i] = 0;
+            removedCount++;
+        }
+    }
+
+    /**
+     * Drops the removed reviews for good, keeping the order of the rest, and
+     * re-indexes. The live reviews move down a run at a time; the runs end at the
+     * zero ratings memchr finds, which the C library scans with the widest vector
+     * instructions the CPU has (chosen at startup), so the columns are not tested
+     * one review at a time.
+     */
+    void purge() {
+        if (removedCount == 0) return;
+        const size_t n = slots();
+        const uint8_t* rating = ratings.data();
+        auto nextRemoved = [&](size_t from) {
+            const void* hit = memchr(rating + from, 0, n - from);
+            return hit ? static_cast<size_t>(static_cast<const uint8_t*>(hit) - rating) : n;
+        };
+        size_t kept = nextRemoved(0);
+        for (size_t i = kept; i < n;) {
+            while (i < n && isRemoved(i)) ++i;
+            if (i == n) break;
+            size_t end = nextRemoved(i); // The live run is [i, end)
+            copy(userIds.begin() + i, userIds.begin() + end, userIds.begin() + kept);
+            copy(productIds.begin() + i, productIds.begin() + end, productIds.begin() + kept);
+            copy(ratings.begin() + i, ratings.begin() + end, ratings.begin() + kept);
+            copy(comments.begin() + i, comments.begin() + end, comments.begin() + kept);
+            kept += end - i;
+            i = end;
+        }
+        userIds.resize(kept);
+        productIds.resize(kept);
+        ratings.resize(kept);
+        comments.resize(kept);
+        removedCount = 0;
+        if (indexed) buildIndexes(); // Positions after the first removed review have shifted
+    }
+
+private:
+    /** Visits the key's reviews through its index, or by scanning the column before the first build. */
+    template <typename Visitor>
+    void forEachIn(const ReviewAdjacency& index, const vector<int>& column, int key, Visitor& visit) const {
+        auto live = [&](size_t i) {
+            if (!isRemoved(i)) visit(i);
+        };
+        if (indexed) {
+            index.forEach(key, live);
+            return;
+        }
+        for (size_t i = 0; i < column.size(); ++i) {
+            if (column[i] == key) live(i);
+        }
+    }
+};
+
+// --- Purchase History ---
+
+/**
+ * Purchase events kept by user: each user's purchased products in the order of
+ * their latest purchase (buying a product again moves it to the end), the set of
+ * (user, product) pairs for constant-time "already bought" checks, and each
+ * product's buyers, so deleting a user or product touches only its own purchases.
+ */
+class PurchaseStore {
+private:
+    unordered_map<int, vector<int>> byUser;
+    unordered_map<int, vector<int>> buyers;
+    unordered_set<long long> pairs;
+
+    static long long key(int userId, int productId) {
+        return (static_cast<long long>(userId) << 32) | static_cast<unsigned int>(productId);
+    }
+
+    static void eraseValue(vector<int>& values, int value) {
+        values.erase(find(values.begin(), values.end(), value));
+    }
+
+public:
+    /** Records a purchase; returns true if the user had not bought this product before. */
+    bool add(int userId, int productId) {
+        vector<int>& bought = byUser[userId];
+        if (!pairs.insert(key(userId, productId)).second) {
+            eraseValue(bought, productId);
+            bought.push_back(productId);
+            return false;
+        }
+        bought.push_back(productId);
+        buyers[productId].push_back(userId);
+        return true;
+    }
+
+    bool contains(int userId, int productId) const { return pairs.count(key(userId, productId)) > 0; }
+
+    /** The user's purchased products, least recently bought first. */
+    const vector<int>& ofUser(int userId) const {
+        static const vector<int> none;
+        auto found = byUser.find(userId);
+        return found == byUser.end() ? none : found->second;
+    }
+
+    bool boughtBySomeone(int productId) const { return buyers.count(productId) > 0; }
+
+    void eraseUser(int userId) {
+        auto found = byUser.find(userId);
+        if (found == byUser.end()) return;
+        for (int productId : found->second) {
+            pairs.erase(key(userId, productId));
+            auto users = buyers.find(productId);
+            eraseValue(users->second, userId);
+            if (users->second.empty()) buyers.erase(users);
+        }
+        byUser.erase(found);
+    }
+
+    void eraseProduct(int productId) {
+        auto found = buyers.find(productId);
+        if (found == buyers.end()) return;
+        for (int userId : found->second) {
+            pairs.erase(key(userId, productId));
+            auto bought = byUser.find(userId);
+            eraseValue(bought->second, productId);
+            if (bought->second.empty()) byUser.erase(bought);
+        }
+        buyers.erase(found);
+    }
+
+    /** Calls fn(userId, products) for every user with purchases, in user id order. */
+    template <typename Fn>
+    void forEachUser(Fn&& fn) const {
+        vector<int> userIds;
+        userIds.reserve(byUser.size());
+        for (const auto& entry : byUser) userIds.push_back(entry.first);
+        sort(userIds.begin(), userIds.end());
+        for (int userId : userIds) fn(userId, byUser.at(userId));
+    }
+
+    size_t size() const { return pairs.size(); }
+    bool empty() const { return pairs.empty(); }
+
+    void clear() {
+        byUser.clear();
+        buyers.clear();
+        pairs.clear();
+    }
+};
+
+// --- 2. Product Class ---
+// Text fields are views: into a mapped data file, or into text storage owned by
+// RecommendationSystem (an arena for names, the category pool for categories).
+class Product {
+private:
+    int id;
+    string_view name;
+    string_view category;
+    double price;
+    int categoryId = -1; // Interned id assigned by RecommendationSystem
+
+public:
+    Product(int id, string_view name, string_view category, double price)
+        : id(id), name(name), category(category), price(price) {}
+
+    // Getters
+    int getId() const { return id; }
+    string_view getName() const { return name; }
+    string_view getCategory() const { return category; }
+    double getPrice() const { return price; }
+    int getCategoryId() const { return categoryId; }
+
+    void setCategoryId(int value) { categoryId = value; }
+
+    // JSON serialization (without rating, as it's calculated externally)
+    void toJson(JsonWriter& out) const {
+        out.raw('{');
+        writeFields(out);
+        out.raw('}');
+    }
+
+    /** The object's fields without the braces, for responses that add their own. */
+    void writeFields(JsonWriter& out) const {
+        out.raw("\"id\":").number(id)
+           .raw(",\"name\":").quoted(name)
+           .raw(",\"category\":").quoted(category)
+           .raw(",\"price\":").fixed(price, 2);
+    }
+};
+
+// --- 3. User Class ---
+// The name is a view, like Product's text fields.
+class User {
+private:
+    int id;
+    string_view name;
+
+public:
+    User(int id, string_view name) : id(id), name(name) {}
+
+    // Getters
+    int getId() const { return id; }
+    string_view getName() const { return name; }
+    
+    // JSON serialization
+    void toJson(JsonWriter& out) const {
+        out.raw("{\"id\":").number(id).raw(",\"name\":").quoted(name).raw('}');
+    }
+};
+
+// --- Rating Aggregates ---
+
+/**
+ * Running rating totals for one product, updated as reviews are added or removed.
+ */
+struct RatingStats {
+    long long sum = 0;
+    int count = 0;
+    array<int, 5> histogram{}; // histogram[r - 1] = number of r-star reviews
+
+    void add(int rating) {
+        sum += rating;
+        count++;
+        if (rating >= 1 && rating <= 5) histogram[rating - 1]++;
+    }
+    void remove(int rating) {
+        sum -= rating;
+        count--;
+        if (rating >= 1 && rating <= 5) histogram[rating - 1]--;
+    }
+    double average() const { return count > 0 ? static_cast<double>(sum) / count : 0.0; }
+
+    void merge(const RatingStats& other) {
+        sum += other.sum;
+        count += other.count;
+        for (size_t r = 0; r < histogram.size(); ++r) histogram[r] += other.histogram[r];
+    }
+};
+
+// Rating totals keyed by product id, e.g. summed over the shards of a ShardRouter
+using RatingTotals = unordered_map<int, RatingStats>;
+
+// Leaderboard entry: products ordered best average rating first (ties by id)
+struct RankedProduct {
+    double rating;
+    int productId;
+    bool operator<(const RankedProduct& other) const {
+        return rating > other.rating || (rating == other.rating && productId < other.productId);
+    }
+};
+
+/**
+ * Rating totals merged over several systems (see ShardRouter) and the category
+ * leaderboards ranked by them. A category's leaderboard is sorted the first time
+ * it is asked for and kept for as long as these totals are current.
+ */
+class MergedRatings {
+public:
+    RatingTotals totals;
+
+    /** The leaderboard of `category`, made by `build` (which returns it unsorted) if it is not kept yet. */
+    template <typename Build>
+    const vector<RankedProduct>& leaderboard(string_view category, Build&& build) const {
+        lock_guard<mutex> guard(boardsLock);
+        auto it = boards.find(string(category));
+        if (it == boards.end()) {
+            vector<RankedProduct> ranked = build();
+            sort(ranked.begin(), ranked.end());
+            it = boards.emplace(string(category), move(ranked)).first;
+        }
+        return it->second; // Never changed once made, and map nodes do not move
+    }
+
+private:
+    mutable mutex boardsLock;
+    mutable unordered_map<string, vector<RankedProduct>> boards;
+};
+
+struct Neighbour {
+    int productId;
+    float similarity;
+};
+
+/**
+ * Top ITEMCF_NEIGHBOURS most similar products for each product, stored as
+ * fixed-width rows in one array (8 bytes per neighbour). Rows of removed
+ * products are recycled.
+ */
+class SimilarityTable {
+private:
+    unordered_map<int, uint32_t> rows;
+    vector<Neighbour> entries; // Row r is entries[r * ITEMCF_NEIGHBOURS, ...)
+    vector<uint8_t> counts;
+    vector<uint32_t> freeRows;
+
+public:
+    void clear() {
+        rows.clear();
+        entries.clear();
+        counts.clear();
+        freeRows.clear();
+    }
+
+    /** Replaces a product's neighbours (best first, at most ITEMCF_NEIGHBOURS). */
+    void set(int productId, const vector<Neighbour>& neighbours) {
+        auto row = rows.find(productId);
+        uint32_t r;
+        if (row != rows.end()) {
+            r = row->second;
+        } else if (!freeRows.empty()) {
+            r = freeRows.back();
+            freeRows.pop_back();
+            rows.emplace(productId, r);
+        } else {
+            r = static_cast<uint32_t>(counts.size());
+            counts.push_back(0);
+            entries.resize(entries.size() + ITEMCF_NEIGHBOURS);
+            rows.emplace(productId, r);
+        }
+        size_t n = min(neighbours.size(), static_cast<size_t>(ITEMCF_NEIGHBOURS));
+        copy(neighbours.begin(), neighbours.begin() + n, entries.begin() + static_cast<size_t>(r) * ITEMCF_NEIGHBOURS);
+        counts[r] = static_cast<uint8_t>(n);
+    }
+
+    void erase(int productId) {
+        auto row = rows.find(productId);
+        if (row == rows.end()) return;
+        counts[row->second] = 0;
+        freeRows.push_back(row->second);
+        rows.erase(row);
+    }
+
+    /** Calls visit(neighbour) for each stored neighbour of the product, best first. */
+    template <typename Visitor>
+    void forEach(int productId, Visitor&& visit) const {
+        auto row = rows.find(productId);
+        if (row == rows.end()) return;
+        const Neighbour* first = entries.data() + static_cast<size_t>(row->second) * ITEMCF_NEIGHBOURS;
+        for (uint8_t i = 0; i < counts[row->second]; ++i) visit(first[i]);
+    }
+};
+
+// --- Catalog Queries ---
+
+/** Options of a paged --get products query; see writeProductsPageJson(). */
+struct ProductQuery {
+    size_t offset = 0;
+    size_t limit = numeric_limits<size_t>::max();
+    string category;         // Empty: every category
+    double minRating = 0.0;  // Lowest average rating included
+    string sort = "id";      // id | rating (best first) | price (cheapest first)
+    string cursor;           // next_cursor of the previous page
+};
+
+// --- Sharding ---
+
+/** The shard (of `shards`) that holds a user along with their reviews and purchases. */
+size_t shardOf(int userId, size_t shards) {
+    // Ids are handed out sequentially, so mix them before taking the remainder
+    uint64_t h = static_cast<uint32_t>(userId);
+    h ^= h >> 16;
+    h *= 0x45d9f3bULL;
+    h ^= h >> 16;
+    return static_cast<size_t>(h % shards);
+}
+
+// --- Recommendation Cache ---
+// Category recommendation replies kept per user. A reply depends only on the
+// user's own reviews and purchases and on the ratings and products of its target
+// category, so the system drops a user's entry when their history changes and
+// bumps a category's version when a rating in it changes or a product joins or
+// leaves it; an entry computed at an older version of its category is stale.
+// The least recently used entries go once the memory budget is exceeded.
+
+class RecommendationCache {
+private:
+    struct Entry {
+        int userId;
+        int k;
+        int categoryId;
+        uint64_t categoryVersion;
+        string json;
+    };
+    list<Entry> entries; // Most recently used first
+    unordered_map<int, list<Entry>::iterator> byUser;
+    vector<uint64_t> categoryVersions;
+    size_t budget = DEFAULT_RECOMMENDATION_CACHE_BYTES;
+    size_t bytes = 0;
+    mutable mutex lock;
+
+    // The reply plus the list node, the index slot and allocator slack
+    static size_t cost(const Entry& entry) { return sizeof(Entry) + entry.json.capacity() + 64; }
+
+    uint64_t versionOf(int categoryId) const {
+        return static_cast<size_t>(categoryId) < categoryVersions.size() ? categoryVersions[categoryId] : 0;
+    }
+
+    void erase(list<Entry>::iterator it) {
+        bytes -= cost(*it);
+        byUser.erase(it->userId);
+        entries.erase(it);
+    }
+
+    void trim() {
+        while (bytes > budget && !entries.empty()) {
+            erase(prev(entries.end()));
+            Metrics::add(RECOMMENDATION_CACHE_EVICTIONS);
+        }
+    }
+
+public:
+    /** Bytes the entries may use; 0 turns the cache off. */
+    void setBudget(size_t value) {
+        lock_guard<mutex> guard(lock);
+        budget = value;
+        trim();
+    }
+
+    /** Copies a still-valid reply for (user, k) into `json`. */
+    bool lookup(int userId, int k, string& json) {
+        lock_guard<mutex> guard(lock);
+        auto found = byUser.find(userId);
+        if (found == byUser.end() || found->second->k != k || found->second->categoryVersion != versionOf(found->second->categoryId)) {
+            Metrics::add(RECOMMENDATION_CACHE_MISSES);
+            return false;
+        }
+        entries.splice(entries.begin(), entries, found->second);
+        json = found->second->json;
+        Metrics::add(RECOMMENDATION_CACHE_HITS);
+        return true;
+    }
+
+    /** Keeps `json`, the reply for (user, k) computed with `categoryId` as the target, replacing any older one. */
+    void store(int userId, int k, int categoryId, string json) {
+        lock_guard<mutex> guard(lock);
+        if (budget == 0) return;
+        auto found = byUser.find(userId);
+        if (found != byUser.end()) erase(found->second);
+        entries.push_front({userId, k, categoryId, versionOf(categoryId), move(json)});
+        byUser.emplace(userId, entries.begin());
+        bytes += cost(entries.front());
+        trim();
+    }
+
+    void invalidateUser(int userId) {
+        lock_guard<mutex> guard(lock);
+        Metrics::add(RECOMMENDATION_CACHE_INVALIDATIONS_USER);
+        auto found = byUser.find(userId);
+        if (found != byUser.end()) erase(found->second);
+    }
+
+    /** Marks every entry targeting the category stale; they are reclaimed as they age out. */
+    void invalidateCategory(int categoryId) {
+        lock_guard<mutex> guard(lock);
+        Metrics::add(RECOMMENDATION_CACHE_INVALIDATIONS_CATEGORY);
+        if (static_cast<size_t>(categoryId) >= categoryVersions.size()) categoryVersions.resize(categoryId + 1, 0);
+        categoryVersions[categoryId]++;
+    }
+
+    /** Drops everything, e.g. after the data was reloaded and category ids may have changed. */
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        entries.clear();
+        byUser.clear();
+        categoryVersions.clear();
+        bytes = 0;
+    }
+
+    size_t size() const { lock_guard<mutex> guard(lock); return entries.size(); }
+    size_t memory() const { lock_guard<mutex> guard(lock); return bytes; }
+};
+
+// --- 4. RecommendationSystem Class ---
+class RecommendationSystem {
+private:
+    // Directory of the data files ("" for the working directory) and their paths
+    const string dataDir;
+    const string productsFile, usersFile, reviewsFile, purchasesFile, logFile;
+
+    vector<Product> products;
+    vector<User> users;
+    ReviewStore reviews;
+    PurchaseStore purchases;
+    int nextProductId = 1000;
+    int nextUserId = 100;
+    bool loaded = false;
+    bool defaultsUnsaved = false; // Set by loadData() after createDefaultData(), cleared by saveDefaultData()
+
+    // Change detection for the in-memory cache of each data file
+    FileStamp productsStamp, usersStamp, reviewsStamp, purchasesStamp;
+
+    // Mapped contents of each data file; loaded names and comments point into these,
+    // so a mapping is only replaced after its collection has been cleared
+    MappedFile productsMapping, usersMapping, reviewsMapping;
+    MappedFile snapshotMapping; // Text of records loaded from a binary snapshot
+
+    // How much of logFile has been applied, and how many records it holds
+    uintmax_t logOffset = 0;
+    int logRecords = 0;
+    atomic<unsigned long long> generation{0}; // Bumped whenever the in-memory data changes
+
+    // Concurrency: any number of readers share dataLock; a mutating command holds
+    // writerLock from start to finish, and dataLock exclusively only while it changes
+    // memory, so readers keep running while its log record is being fsynced.
+    mutable shared_mutex dataLock;
+    mutable mutex writerLock;
+
+    // Other processes: whoever holds writerLock also owns this lock's use (see FileLock)
+    FileLock filesLock{dataPath(LOCK_FILE)};
+
+    // Lookup indexes: id -> position in the vectors, and every (user, product) review pair
+    unordered_map<int, size_t> productIndex;
+    unordered_map<int, size_t> userIndex;
+    unordered_set<long long> reviewedPairs;
+
+    // Per-product rating totals, keyed by product id
+    unordered_map<int, RatingStats> ratingStats;
+
+    // Interned categories (ids stay stable across reloads) and their product ids in catalog order.
+    // The names live in categoryText, which is never cleared, so products can point at them.
+    TextArena categoryText;
+    vector<string_view> categoryNames;
+    unordered_map<string_view, int> categoryIds;
+    vector<vector<int>> categoryProducts;
+
+    // Product and user names that cannot be borrowed from a mapping (unescaped or
+    // added at runtime). Freed all at once when the table is reloaded.
+    TextArena productText;
+    TextArena userText;
+
+    // Per-category leaderboard, best average rating first
+    vector<set<RankedProduct>> categoryLeaderboards;
+
+    // Workers for the bulk rebuilds (indexes, rating totals, leaderboards, similarity)
+    ThreadPool pool;
+
+    // Item-item neighbours for --strategy itemcf. Built in full on first use; after
+    // that a review change only marks the products whose similarities it moves.
+    SimilarityTable similarity;
+    bool similarityBuilt = false;
+    unordered_set<int> staleSimilarity;
+
+    // Replies of getRecommendationsJson(); the in-memory mutations below invalidate
+    // the users and categories they touch, and full (re)loads clear it
+    RecommendationCache recommendationCache;
+
+    /**
+     * Attempts to create initial default data if no files exist.
+     */
+    void createDefaultData() {
+        products.emplace_back(1000, "Mechanical Keyboard", categoryName("Electronics"), 99.99);
+        products.emplace_back(1001, "Wireless Mouse", categoryName("Electronics"), 45.50);
+        products.emplace_back(1002, "The Silent Patient Book", categoryName("Books"), 12.00);
+        products.emplace_back(1003, "Blue Hoodie", categoryName("Apparel"), 65.00);
+        nextProductId = 1004;
+
+        users.emplace_back(100, "Alice Johnson");
+        users.emplace_back(101, "Bob Smith");
+        nextUserId = 102;
+
+        reviews.add(100, 1000, 5, "Excellent keyboard for coding.");
+        reviews.add(100, 1001, 4, "Reliable mouse, good battery life.");
+        reviews.add(101, 1002, 3, "A decent thriller, a bit slow.");
+        reviews.add(101, 1003, 5, "Comfy and warm!");
+
+        rebuildProductIndex();
+        rebuildUserIndex();
+        rebuildReviewIndex();
+        rebuildRatingStats();
+        rebuildLeaderboards();
+        invalidateSimilarity();
+    }
+
+    // --- Index Maintenance ---
+
+    // Ratings are 1-5; 0 marks a removed review in ReviewStore, so anything outside
+    // the range is refused wherever reviews enter: commands, data files, the log
+    static bool isValidRating(int rating) { return rating >= 1 && rating <= 5; }
+
+    static long long reviewKey(int userId, int productId) {
+        return (static_cast<long long>(userId) << 32) | static_cast<unsigned int>(productId);
+    }
+
+    // On duplicate ids the first occurrence wins, matching the old linear scans
+    void rebuildProductPositions() {
+        productIndex.clear();
+        productIndex.reserve(products.size());
+        for (size_t i = 0; i < products.size(); ++i) productIndex.emplace(products[i].getId(), i);
+    }
+    void rebuildProductIndex() {
+        rebuildProductPositions();
+        for (auto& members : categoryProducts) members.clear();
+        for (size_t i = 0; i < products.size(); ++i) {
+            if (productIndex[products[i].getId()] == i) indexProductCategory(products[i]);
+        }
+    }
+
+    /** Returns the small integer id for a category name, assigning a new one if unseen. */
+    int internCategory(string_view category) {
+        auto it = categoryIds.find(category);
+        if (it != categoryIds.end()) return it->second;
+        int id = static_cast<int>(categoryNames.size());
+        categoryNames.push_back(categoryText.store(category));
+        categoryProducts.emplace_back();
+        categoryLeaderboards.emplace_back();
+        categoryIds.emplace(categoryNames.back(), id);
+        return id;
+    }
+
+    /** The pooled copy of a category name, for storing in a Product. */
+    string_view categoryName(string_view category) { return categoryNames[internCategory(category)]; }
+
+    void indexProductCategory(Product& product) {
+        product.setCategoryId(internCategory(product.getCategory()));
+        categoryProducts[product.getCategoryId()].push_back(product.getId());
+    }
+    void rebuildUserIndex() {
+        userIndex.clear();
+        userIndex.reserve(users.size());
+        for (size_t i = 0; i < users.size(); ++i) userIndex.emplace(users[i].getId(), i);
+    }
+    void rebuildReviewIndex() {
+        reviews.buildIndexes(&pool);
+        reviewedPairs.clear();
+        reviewedPairs.reserve(reviews.size());
+        const vector<int>& userIds = reviews.userIdColumn();
+        const vector<int>& productIds = reviews.productIdColumn();
+        for (size_t i = 0; i < userIds.size(); ++i) {
+            if (!reviews.isRemoved(i)) reviewedPairs.insert(reviewKey(userIds[i], productIds[i]));
+        }
+    }
+    /** Sums every product's ratings in parallel by product; runs right after rebuildReviewIndex(). */
+    void rebuildRatingStats() {
+        const vector<int>& productIds = reviews.indexedProducts();
+        vector<RatingStats> totals(productIds.size());
+        pool.parallelFor(productIds.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                reviews.forEachOfProduct(productIds[i], [&](size_t p) { totals[i].add(reviews.rating(p)); });
+            }
+        });
+
+        ratingStats.clear();
+        ratingStats.reserve(productIds.size());
+        for (size_t i = 0; i < productIds.size(); ++i) ratingStats.emplace(productIds[i], totals[i]);
+    }
+    void rebuildLeaderboards() {
+        // Each category's board is independent, so categories are filled in parallel
+        pool.parallelFor(categoryProducts.size(), 1, [this](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; ++c) {
+                categoryLeaderboards[c].clear();
+                for (int productId : categoryProducts[c]) {
+                    categoryLeaderboards[c].insert({calculateAverageRating(productId), productId});
+                }
+            }
+        });
+    }
+
+    /** Adds (or removes) one rating from a product's totals and moves it on its leaderboard. */
+    void applyRating(int productId, int rating, bool adding) {
+        RatingStats& stats = ratingStats[productId];
+        const Product* product = findProductById(productId);
+        if (product) categoryLeaderboards[product->getCategoryId()].erase({stats.average(), productId});
+        if (adding) stats.add(rating); else stats.remove(rating);
+        if (product) {
+            categoryLeaderboards[product->getCategoryId()].insert({stats.average(), productId});
+            recommendationCache.invalidateCategory(product->getCategoryId());
+        }
+    }
+
+    /** Rating totals for a product (all zero if it has no reviews). */
+    const RatingStats& getRatingStats(int productId) const {
+        static const RatingStats none;
+        auto it = ratingStats.find(productId);
+        return it != ratingStats.end() ? it->second : none;
+    }
+
+    /** A product's totals from `totals` when given (a router's merged view), else our own. */
+    const RatingStats& getRatingStats(int productId, const RatingTotals* totals) const {
+        static const RatingStats none;
+        if (!totals) return getRatingStats(productId);
+        auto it = totals->find(productId);
+        return it != totals->end() ? it->second : none;
+    }
+
+
+    // --- Persistence Methods ---
+
+    /** Maps a data file for parsing; a missing or empty file reads as an empty array. */
+    static string_view mapDataFile(MappedFile& mapping, const string& filename) {
+        if (!mapping.open(filename)) {
+            cerr << "DEBUG C++: File not found or failed to open: " << filename << endl; 
+            return "[]";
+        }
+        return mapping.view().empty() ? string_view("[]") : mapping.view();
+    }
+    
+    static void reportParseError(const JsonReader& reader, const string& filename) {
+        if (!reader.ok()) {
+            cerr << "DEBUG C++: Malformed JSON in " << filename << " near byte " << reader.errorOffset()
+                 << ", records after it were skipped." << endl;
+        }
+    }
+
+    /** Replaces the products with the contents of productsFile. Returns true if any were read. */
+    bool loadProducts() {
+        MetricTimer timer(LOAD_NS_PRODUCTS);
+        Metrics::add(LOADS_PRODUCTS);
+        products.clear();
+        productText.clear();
+        nextProductId = 1000;
+        productsStamp = statFile(productsFile);
+
+        string_view text = mapDataFile(productsMapping, productsFile);
+        Metrics::add(LOAD_BYTES_PRODUCTS, text.size());
+        JsonReader reader(text);
+        reader.readArray([this](JsonReader& r) {
+            int id = 0;
+            double price = 0.0;
+            TextRef name, category;
+            bool hasId = false, hasPrice = false;
+            r.readObject([&](string_view key, JsonReader& value) {
+                if (key == "id") hasId = value.readInt(id);
+                else if (key == "name") value.readText(name);
+                else if (key == "category") value.readText(category);
+                else if (key == "price") hasPrice = value.readDouble(price);
+                else value.skipValue();
+            });
+            if (r.ok() && hasId && hasPrice) {
+                products.emplace_back(id, storeText(productText, name), categoryName(category.view()), price);
+                nextProductId = max(nextProductId, id + 1);
+            }
+        });
+        reportParseError(reader, productsFile);
+
+        rebuildProductIndex();
+        rebuildLeaderboards();
+        invalidateSimilarity();
+        generation++;
+        return !products.empty();
+    }
+
+    /** Replaces the users with the contents of usersFile. Returns true if any were read. */
+    bool loadUsers() {
+        MetricTimer timer(LOAD_NS_USERS);
+        Metrics::add(LOADS_USERS);
+        users.clear();
+        userText.clear();
+        nextUserId = 100;
+        usersStamp = statFile(usersFile);
+
+        string_view text = mapDataFile(usersMapping, usersFile);
+        Metrics::add(LOAD_BYTES_USERS, text.size());
+        JsonReader reader(text);
+        reader.readArray([this](JsonReader& r) {
+            int id = 0;
+            TextRef name;
+            bool hasId = false;
+            r.readObject([&](string_view key, JsonReader& value) {
+                if (key == "id") hasId = value.readInt(id);
+                else if (key == "name") value.readText(name);
+                else value.skipValue();
+            });
+            if (r.ok() && hasId) {
+                users.emplace_back(id, storeText(userText, name));
+                nextUserId = max(nextUserId, id + 1);
+            }
+        });
+        reportParseError(reader, usersFile);
+
+        rebuildUserIndex();
+        generation++;
+        return !users.empty();
+    }
+
+    /** Replaces the reviews with the contents of reviewsFile. Returns true if any were read. */
+    bool loadReviews() {
+        MetricTimer timer(LOAD_NS_REVIEWS);
+        Metrics::add(LOADS_REVIEWS);
+        reviews.clear();
+        reviewsStamp = statFile(reviewsFile);
+
+        string_view text = mapDataFile(reviewsMapping, reviewsFile);
+        Metrics::add(LOAD_BYTES_REVIEWS, text.size());
+        JsonReader reader(text);
+        size_t invalid = 0;
+        reader.readArray([this, &invalid](JsonReader& r) {
+            int uid = 0, pid = 0, rating = 0;
+            TextRef comment;
+            bool hasUser = false, hasProduct = false, hasRating = false;
+            r.readObject([&](string_view key, JsonReader& value) {
+                if (key == "user_id") hasUser = value.readInt(uid);
+                else if (key == "product_id") hasProduct = value.readInt(pid);
+                else if (key == "rating") hasRating = value.readInt(rating);
+                else if (key == "comment") value.readText(comment);
+                else value.skipValue();
+            });
+            if (!r.ok() || !hasUser || !hasProduct || !hasRating) return;
+            if (isValidRating(rating)) reviews.add(uid, pid, rating, comment);
+            else invalid++;
+        });
+        reportParseError(reader, reviewsFile);
+        if (invalid > 0) cerr << "DEBUG C++: Skipped " << invalid << " reviews with a rating outside 1-5 in " << reviewsFile << endl;
+
+        rebuildReviewIndex();
+        rebuildRatingStats();
+        rebuildLeaderboards();
+        invalidateSimilarity();
+        generation++;
+        return !reviews.empty();
+    }
+
+    /**
+     * Replaces the purchases with the contents of purchasesFile, records of the form
+     * {"user_id":100,"product_ids":[1002,1000]} (least recently bought first). The file
+     * is optional. Returns true if any purchases were read.
+     */
+    bool loadPurchases() {
+        purchases.clear();
+        purchasesStamp = statFile(purchasesFile);
+        if (!purchasesStamp.exists) return false;
+
+        MappedFile mapping; // Nothing points into the text afterwards
+        JsonReader reader(mapDataFile(mapping, purchasesFile));
+        reader.readArray([this](JsonReader& r) {
+            int uid = 0;
+            vector<int> productIds;
+            bool hasUser = false;
+            r.readObject([&](string_view key, JsonReader& value) {
+                if (key == "user_id") hasUser = value.readInt(uid);
+                else if (key == "product_ids") {
+                    value.readArray([&](JsonReader& item) {
+                        int pid = 0;
+                        if (item.readInt(pid)) productIds.push_back(pid);
+                    });
+                } else value.skipValue();
+            });
+            if (!r.ok() || !hasUser || !findUserById(uid)) return;
+            for (int pid : productIds) {
+                if (findProductById(pid)) purchases.add(uid, pid);
+            }
+        });
+        reportParseError(reader, purchasesFile);
+        generation++;
+        return !purchases.empty();
+    }
+
+    /** Reads all data from JSON files into memory, then applies the mutation log. */
+    void loadData() {
+        recommendationCache.clear();
+        // Every loader runs, so no short-circuiting here
+        bool data_loaded = loadProducts();
+        data_loaded = loadUsers() || data_loaded;
+        data_loaded = loadReviews() || data_loaded;
+        data_loaded = loadPurchases() || data_loaded;
+        replayLog(0);
+        data_loaded = data_loaded || !products.empty() || !users.empty() || !reviews.empty() || !purchases.empty();
+        
+        // If no persistent data was found, create the default set; the caller saves it
+        if (!data_loaded) {
+            createDefaultData();
+            defaultsUnsaved = true;
+        }
+        loaded = true;
+    }
+
+    /**
+     * Writes the default data of a first run to the JSON files (temp file + fsync +
+     * rename each). Called with `data` held exclusively and the writer lock held; like
+     * compactData, it renders under a shared lock and fsyncs under none, so readers
+     * are served the defaults meanwhile. Returns with `data` held again.
+     */
+    void saveDefaultData(unique_lock<shared_mutex>& data) {
+        defaultsUnsaved = false;
+        data.unlock();
+        array<string, 4> files;
+        {
+            shared_lock<shared_mutex> reading(dataLock);
+            files = renderDataFiles();
+        }
+        bool staged = stageDataFiles(files);
+        data.lock();
+        if (staged) installDataFiles();
+        generation++;
+    }
+
+    /**
+     * The products, users, reviews and purchases files as text, in that order;
+     * removed reviews are left out. With `shards` > 1 only the users (and their
+     * reviews and purchases) that shardOf() places on `shard` are kept; every
+     * shard keeps the whole catalog.
+     */
+    array<string, 4> renderDataFiles(size_t shard = 0, size_t shards = 1) const {
+        auto onShard = [&](int userId) { return shards <= 1 || shardOf(userId, shards) == shard; };
+        // Helper to render the kept ones of `count` JSON objects as a file
+        auto renderRecords = [](size_t count, const auto& keep, const auto& recordJson) {
+            JsonWriter out;
+            out.raw("[\n");
+            bool first = true;
+            for (size_t i = 0; i < count; ++i) {
+                if (!keep(i)) continue;
+                if (!first) out.raw(",\n");
+                recordJson(out, i);
+                first = false;
+            }
+            out.raw(first ? "]" : "\n]");
+            return out.take();
+        };
+        return {
+            renderRecords(products.size(), [](size_t) { return true; }, [this](JsonWriter& out, size_t i) { products[i].toJson(out); }),
+            renderRecords(users.size(), [&](size_t i) { return onShard(users[i].getId()); },
+                          [this](JsonWriter& out, size_t i) { users[i].toJson(out); }),
+            renderRecords(reviews.slots(), [&](size_t i) { return !reviews.isRemoved(i) && onShard(reviews.userId(i)); },
+                          [this](JsonWriter& out, size_t i) { reviews.row(i).toJson(out); }),
+            renderPurchases(onShard)
+        };
+    }
+
+    template <typename Keep>
+    string renderPurchases(const Keep& keep) const {
+        JsonWriter out;
+        out.raw("[\n");
+        bool first = true;
+        purchases.forEachUser([&](int userId, const vector<int>& productIds) {
+            if (!keep(userId)) return;
+            if (!first) out.raw(",\n");
+            first = false;
+            out.raw("{\"user_id\":").number(userId).raw(",\"product_ids\":[");
+            for (size_t i = 0; i < productIds.size(); ++i) {
+                if (i > 0) out.raw(',');
+                out.number(productIds[i]);
+            }
+            out.raw("]}");
+        });
+        out.raw(first ? "]" : "\n]");
+        return out.take();
+    }
+
+    /** Writes rendered data files to their temp names and fsyncs them. Touches no data. */
+    bool stageDataFiles(const array<string, 4>& files) const {
+        MetricTimer timer(SAVE_NS);
+        Metrics::add(SAVES);
+        Metrics::add(SAVE_BYTES, files[0].size() + files[1].size() + files[2].size() + files[3].size());
+        return writeTempFileContents(productsFile, files[0]) && writeTempFileContents(usersFile, files[1]) &&
+               writeTempFileContents(reviewsFile, files[2]) && writeTempFileContents(purchasesFile, files[3]);
+    }
+
+    /** Renames the staged data files into place and re-stamps them. */
+    void installDataFiles() {
+        // Re-stamp after each write so our own saves never look like external changes
+        replaceWithTempFile(productsFile); productsStamp = statFile(productsFile);
+        replaceWithTempFile(usersFile); usersStamp = statFile(usersFile);
+        replaceWithTempFile(reviewsFile); reviewsStamp = statFile(reviewsFile);
+        replaceWithTempFile(purchasesFile); purchasesStamp = statFile(purchasesFile);
+        syncParentDirectory(productsFile);
+    }
+
+    // --- Mutation Log ---
+    // A change is applied in memory and then appended to logFile as one
+    // JSON line in the same shape as a data file record plus an "op" field, e.g.
+    // {"op":"add_review","user_id":100,"product_id":1002,"rating":5,"comment":"..."}.
+    // Loading replays the log over the JSON files. Replay is idempotent (adds of
+    // existing ids and deletes of missing ones are skipped), so replaying records
+    // that are already part of the JSON files is harmless. A bulk user delete is one
+    // {"op":"delete_users","ids":[101,102]} record. Purchases are logged as
+    // {"op":"purchase","user_id":100,"product_id":1002}; replaying a recorded one
+    // only makes it the user's latest purchase again.
+
+    /** Applies log records from byte `from` up to the last complete line. */
+    void replayLog(uintmax_t from) {
+        MetricTimer timer(LOG_REPLAY_NS);
+        if (from == 0) logRecords = 0;
+        logOffset = from;
+
+        ifstream ifs(logFile, ios::binary);
+        if (!ifs.is_open()) { logOffset = 0; return; }
+        ifs.seekg(static_cast<streamoff>(from));
+        string tail((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+        size_t start = 0;
+        for (size_t end = tail.find('\n'); end != string::npos; end = tail.find('\n', start)) {
+            string_view line(tail.data() + start, end - start);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (!line.empty()) {
+                if (!applyLogRecord(line)) cerr << "DEBUG C++: Skipped malformed record in " << logFile << endl;
+                logRecords++;
+                Metrics::add(LOG_REPLAYED_RECORDS);
+            }
+            start = end + 1;
+        }
+        // A trailing partial line is a write in progress or torn by a crash; leave it
+        logOffset = from + start;
+    }
+
+    /** The fields of one log record or --batch command; absent fields keep their defaults. */
+    struct MutationRecord {
+        string op, name, category, comment;
+        vector<int> ids; // delete_users
+        int id = 0, userId = 0, productId = 0, rating = 0;
+        double price = 0.0;
+        bool hasId = false, hasUser = false, hasProduct = false, hasRating = false, hasPrice = false;
+
+        /** Reads one JSON object line. Returns false if it is malformed. */
+        bool parse(string_view line) {
+            JsonReader reader(line);
+            reader.readObject([&](string_view key, JsonReader& value) {
+                if (key == "op") value.readString(op);
+                else if (key == "id") hasId = value.readInt(id);
+                else if (key == "name") value.readString(name);
+                else if (key == "category") value.readString(category);
+                else if (key == "price") hasPrice = value.readDouble(price);
+                else if (key == "user_id") hasUser = value.readInt(userId);
+                else if (key == "product_id") hasProduct = value.readInt(productId);
+                else if (key == "rating") hasRating = value.readInt(rating);
+                else if (key == "comment") value.readString(comment);
+                else if (key == "ids") {
+                    value.readArray([&](JsonReader& item) {
+                        int listed = 0;
+                        if (item.readInt(listed)) ids.push_back(listed);
+                    });
+                } else value.skipValue();
+            });
+            return reader.ok();
+        }
+    };
+
+    /** Parses one log line and applies it. Returns false if the line is malformed. */
+    bool applyLogRecord(string_view line) {
+        MutationRecord record;
+        if (!record.parse(line)) return false;
+
+        const string& op = record.op;
+        if (op == "add_user" && record.hasId) applyAddUser(record.id, move(record.name));
+        else if (op == "add_product" && record.hasId && record.hasPrice) applyAddProduct(record.id, move(record.name), record.category, record.price);
+        else if (op == "add_review" && record.hasUser && record.hasProduct && record.hasRating) applyAddReview(record.userId, record.productId, record.rating, move(record.comment));
+        else if (op == "delete_user" && record.hasId) applyDeleteUser(record.id);
+        else if (op == "delete_users") applyDeleteUsers(record.ids);
+        else if (op == "delete_product" && record.hasId) applyDeleteProduct(record.id);
+        else if (op == "purchase" && record.hasUser && record.hasProduct) applyPurchase(record.userId, record.productId);
+        else return false;
+        return true;
+    }
+
+    /** Appends one log line for a change to `log`: {"id":..} -> {"op":"add_user","id":..} */
+    static void appendLogRecord(string& log, const string& op, string_view recordJson) {
+        log += "{\"op\":\"";
+        log += op;
+        log += "\",";
+        log.append(recordJson.substr(1));
+        log += '\n';
+    }
+
+    /** Locks held by a mutating command (released in reverse order); see beginWrite(). */
+    struct WriteLocks {
+        unique_lock<mutex> writer;
+        FileLockGuard files;
+        unique_lock<shared_mutex> data;
+    };
+
+    /**
+     * Starts a mutating command: waits for other writers in this process and in
+     * others, then locks and refreshes the data, so the change is validated
+     * against everything written before it.
+     */
+    WriteLocks beginWrite() {
+        unique_lock<mutex> writer(writerLock);
+        FileLockGuard files(filesLock, true);
+        WriteLocks locks{move(writer), move(files), unique_lock<shared_mutex>(dataLock)};
+        refreshData();
+        if (defaultsUnsaved) saveDefaultData(locks.data); // Before the change is logged on top of them
+        return locks;
+    }
+
+    /**
+     * Starts a read: returns a shared lock on fresh data. Changed data files (and,
+     * with withSimilarity, stale similarity rows) are brought up to date under the
+     * exclusive lock first. File changes are only picked up when no write is in
+     * progress here or in another process (LOCK_FILE), since that writer's log record
+     * may not have landed yet; readers that meet one serve the current in-memory state
+     * instead of waiting for its fsync.
+     */
+    shared_lock<shared_mutex> beginRead(bool withSimilarity = false) {
+        for (;;) {
+            shared_lock<shared_mutex> reading(dataLock);
+            bool refreshFiles = !loaded || dataFilesChanged();
+            bool refreshTable = withSimilarity && (!similarityBuilt || !staleSimilarity.empty());
+            if (!refreshFiles && !refreshTable) return reading;
+            reading.unlock();
+
+            // Only the first load has nothing to serve meanwhile and waits for writers
+            unique_lock<mutex> writer(writerLock, defer_lock);
+            FileLockGuard files;
+            if (refreshFiles) {
+                if (!loaded) {
+                    writer.lock();
+                    files = FileLockGuard(filesLock, false);
+                } else if (writer.try_lock()) {
+                    files = FileLockGuard(filesLock, false, false);
+                }
+                if (loaded && !files.owns()) {
+                    if (!refreshTable) {
+                        reading.lock();
+                        return reading;
+                    }
+                    refreshFiles = false;
+                }
+            }
+            unique_lock<shared_mutex> writing(dataLock);
+            if (refreshFiles) refreshData();
+            if (defaultsUnsaved) saveDefaultData(writing);
+            if (refreshTable && loaded) refreshSimilarity();
+        }
+    }
+
+    /** True if a data file or the log differs from what memory reflects. */
+    bool dataFilesChanged() const {
+        return statFile(productsFile) != productsStamp || statFile(usersFile) != usersStamp ||
+               statFile(reviewsFile) != reviewsStamp || statFile(purchasesFile) != purchasesStamp ||
+               statFile(logFile).size != logOffset;
+    }
+
+    /**
+     * Finishes a mutating command whose changes are already applied in memory:
+     * durably appends their log lines (`records` of them, see appendLogRecord) in
+     * one write and compacts the log once it has grown long enough. The data lock
+     * is released for the disk work and stays released. Returns false if the
+     * records could not be written; memory then holds changes the log does not,
+     * so it is marked for a full reload on the next command.
+     */
+    bool commitMutation(WriteLocks& locks, const string& lines, int records) {
+        if (records == 0) {
+            locks.data.unlock();
+            return true;
+        }
+
+        locks.data.unlock(); // Readers go ahead while the records are made durable
+        FileStamp before = statFile(logFile);
+        bool appended;
+        {
+            MetricTimer timer(LOG_APPEND_NS);
+            appended = appendDurably(logFile, lines);
+        }
+        FileStamp after = statFile(logFile);
+        Metrics::add(LOG_APPENDS);
+        Metrics::add(LOG_APPEND_BYTES, lines.size());
+
+        locks.data.lock();
+        if (!appended) {
+            loaded = false; // Never serve changes that are not on disk
+            locks.data.unlock();
+            return false;
+        }
+        // Only skip our own records on the next replay if nobody appended in between
+        if (before.size == logOffset && after.size == logOffset + lines.size()) logOffset = after.size;
+        logRecords += records;
+
+        if (logRecords >= COMPACT_LOG_RECORDS) compactData(locks);
+        else locks.data.unlock();
+        return true;
+    }
+
+    /**
+     * Folds the log into the JSON files and starts a new, empty log. A crash in
+     * between leaves the old log over JSON files that may be a mix of new and old
+     * ones (the renames are not atomic as a set). Replaying it converges anyway:
+     * adds of records already present are skipped, and deletes remove the reviews
+     * and purchases of a user or product even when its row is already gone.
+     * Called with the data lock held exclusively; rendering runs under a shared
+     * lock and the fsyncs under none, so readers only wait for the purge of
+     * removed reviews and the renames.
+     * Returns with the data lock released.
+     */
+    void compactData(WriteLocks& locks) {
+        reviews.purge(); // Removed reviews are dropped for good along with the log
+        locks.data.unlock();
+        array<string, 4> files;
+        {
+            shared_lock<shared_mutex> reading(dataLock);
+            files = renderDataFiles();
+        }
+        bool staged = stageDataFiles(files) && writeTempFileContents(logFile, string());
+
+        locks.data.lock();
+        if (staged) {
+            installDataFiles();
+            replaceWithTempFile(logFile);
+            logOffset = 0;
+            logRecords = 0;
+            generation++;
+        }
+        locks.data.unlock();
+        syncParentDirectory(logFile);
+    }
+    
+    /**
+     * Brings memory up to date with the data files. Only files whose size or
+     * modification time changed since we last read or wrote them are parsed again,
+     * and only the part of the log appended since the last look is replayed.
+     */
+    void refreshData() {
+        if (!loaded) {
+            loadData();
+            return;
+        }
+        bool reloaded = false;
+        if (statFile(productsFile) != productsStamp) { loadProducts(); reloaded = true; }
+        if (statFile(usersFile) != usersStamp) { loadUsers(); reloaded = true; }
+        if (statFile(reviewsFile) != reviewsStamp) { loadReviews(); reloaded = true; }
+        if (statFile(purchasesFile) != purchasesStamp) { loadPurchases(); reloaded = true; }
+
+        // A reloaded file has lost the logged changes on top of it, and a log that
+        // shrank was compacted by someone else: both mean replaying it from the start
+        uintmax_t logSize = statFile(logFile).size;
+        if (reloaded || logSize < logOffset) {
+            recommendationCache.clear();
+            replayLog(0);
+        }
+        else if (logSize > logOffset) replayLog(logOffset);
+    }
+    
+    // Helper to calculate the average rating for a product
+    double calculateAverageRating(int productId) const {
+        return getRatingStats(productId).average();
+    }
+
+    // Helper functions (Finders), O(1) through the indexes
+    const Product* findProductById(int productId) const {
+        auto it = productIndex.find(productId);
+        return it != productIndex.end() ? &products[it->second] : nullptr;
+    }
+    const User* findUserById(int userId) const {
+        auto it = userIndex.find(userId);
+        return it != userIndex.end() ? &users[it->second] : nullptr;
+    }
+    
+    // Helper to check if a user has reviewed a product
+    bool hasUserReviewed(int userId, int productId) const {
+        return reviewedPairs.count(reviewKey(userId, productId)) > 0;
+    }
+
+    // Helper to get all product IDs reviewed by a user
+    vector<int> getReviewedProductIds(int userId) const {
+        vector<int> reviewed_ids;
+        for (size_t i : reviews.findByUser(userId)) {
+            reviewed_ids.push_back(reviews.productId(i));
+        }
+        return reviewed_ids;
+    }
+
+    // --- Item-Item Similarity ---
+    // sim(i, j) = sum_u r_ui * r_uj / (|r_i| * |r_j|), the cosine of the two
+    // products' rating vectors over the users who reviewed both.
+
+    /** Euclidean norm of a product's rating vector, from its rating histogram. */
+    double ratingNorm(int productId) const {
+        const RatingStats& stats = getRatingStats(productId);
+        double sumSquares = 0.0;
+        for (int r = 1; r <= 5; ++r) sumSquares += static_cast<double>(stats.histogram[r - 1]) * r * r;
+        return sqrt(sumSquares);
+    }
+
+    /**
+     * Per-thread accumulator of dot products keyed by product id. Ids are normally
+     * handed out sequentially, so a flat array over the id range is used when the
+     * range is not much larger than the catalogue; otherwise a hash map.
+     */
+    struct DotAccumulator {
+        int base = 0;
+        vector<double> dense;
+        vector<double> norms; // ratingNorm() of each id in the dense range
+        vector<int> touched;
+        unordered_map<int, double> sparse;
+
+        void add(int productId, double value) {
+            if (dense.empty()) { sparse[productId] += value; return; }
+            long long slot = static_cast<long long>(productId) - base;
+            if (slot < 0 || slot >= static_cast<long long>(dense.size())) return; // Orphan review: no catalog entry
+            double& dot = dense[static_cast<size_t>(slot)];
+            if (dot == 0.0) touched.push_back(productId); // Ratings are positive, so 0 means unseen
+            dot += value;
+        }
+
+        /** Calls visit(productId, dot, norm) for every accumulated catalog product and resets. */
+        template <typename Visitor>
+        void drain(const RecommendationSystem& system, Visitor&& visit) {
+            for (int productId : touched) {
+                size_t slot = static_cast<size_t>(productId - base);
+                visit(productId, dense[slot], norms[slot]);
+                dense[slot] = 0.0;
+            }
+            touched.clear();
+            for (const auto& entry : sparse) {
+                if (system.findProductById(entry.first)) visit(entry.first, entry.second, system.ratingNorm(entry.first));
+            }
+            sparse.clear();
+        }
+    };
+
+    DotAccumulator makeDotAccumulator() const {
+        DotAccumulator dots;
+        if (products.empty()) return dots;
+        auto range = minmax_element(products.begin(), products.end(), [](const Product& a, const Product& b) { return a.getId() < b.getId(); });
+        long long span = static_cast<long long>(range.second->getId()) - range.first->getId() + 1;
+        if (span <= 4 * static_cast<long long>(products.size()) + 1024) {
+            dots.base = range.first->getId();
+            dots.dense.assign(static_cast<size_t>(span), 0.0);
+            dots.norms.assign(static_cast<size_t>(span), 0.0);
+            for (const auto& p : products) dots.norms[static_cast<size_t>(p.getId() - dots.base)] = ratingNorm(p.getId());
+        }
+        return dots;
+    }
+
+    /** Most similar products to one product, best first. */
+    vector<Neighbour> computeNeighbours(int productId, DotAccumulator& dots) const {
+        reviews.forEachOfProduct(productId, [&](size_t p) {
+            int rating = reviews.rating(p);
+            reviews.forEachOfUser(reviews.userId(p), [&](size_t q) {
+                if (reviews.productId(q) != productId) dots.add(reviews.productId(q), static_cast<double>(rating) * reviews.rating(q));
+            });
+        });
+
+        vector<Neighbour> neighbours;
+        double norm = ratingNorm(productId);
+        dots.drain(*this, [&](int otherId, double dot, double otherNorm) {
+            double denominator = norm * otherNorm;
+            if (denominator > 0.0) neighbours.push_back({otherId, static_cast<float>(dot / denominator)});
+        });
+        auto better = [](const Neighbour& a, const Neighbour& b) {
+            return a.similarity != b.similarity ? a.similarity > b.similarity : a.productId < b.productId;
+        };
+        size_t keep = min(neighbours.size(), static_cast<size_t>(ITEMCF_NEIGHBOURS));
+        partial_sort(neighbours.begin(), neighbours.begin() + keep, neighbours.end(), better);
+        neighbours.resize(keep);
+        return neighbours;
+    }
+
+    /** Recomputes the neighbour rows of the given products in parallel. */
+    void buildSimilarity(const vector<int>& productIds) {
+        MetricTimer timer(SIMILARITY_BUILD_NS);
+        Metrics::add(SIMILARITY_ROWS_BUILT, productIds.size());
+        vector<vector<Neighbour>> rows(productIds.size());
+        pool.parallelFor(productIds.size(), [&](size_t begin, size_t end) {
+            DotAccumulator dots = makeDotAccumulator();
+            for (size_t i = begin; i < end; ++i) rows[i] = computeNeighbours(productIds[i], dots);
+        });
+        for (size_t i = 0; i < productIds.size(); ++i) similarity.set(productIds[i], rows[i]);
+    }
+
+    /** Brings the similarity table up to date: a full build the first time, then only stale rows. */
+    void refreshSimilarity() {
+        vector<int> pending;
+        if (!similarityBuilt) {
+            similarity.clear();
+            for (const auto& p : products) pending.push_back(p.getId());
+        } else {
+            for (int productId : staleSimilarity) {
+                if (findProductById(productId)) pending.push_back(productId);
+            }
+        }
+        buildSimilarity(pending);
+        similarityBuilt = true;
+        staleSimilarity.clear();
+    }
+
+    /**
+     * Marks every product whose similarities change when one of this product's
+     * reviews is added or removed: the product itself (its norm moves) and every
+     * product that shares a reviewer with it.
+     */
+    void markSimilarityStale(int productId) {
+        if (!similarityBuilt) return;
+        staleSimilarity.insert(productId);
+        reviews.forEachOfProduct(productId, [&](size_t p) {
+            reviews.forEachOfUser(reviews.userId(p), [&](size_t q) { staleSimilarity.insert(reviews.productId(q)); });
+        });
+    }
+
+    /** Drops the whole table; the next itemcf request rebuilds it. */
+    void invalidateSimilarity() {
+        similarityBuilt = false;
+        staleSimilarity.clear();
+        similarity.clear();
+    }
+
+    /** One recommendation entry: the product's JSON plus its rating summary (`stats`) and the fields `extra` writes. */
+    template <typename Extra>
+    void appendRecommendation(JsonWriter& out, int productId, const RatingStats& stats, Extra&& extra) const {
+        out.raw('{');
+        findProductById(productId)->writeFields(out);
+        out.raw(", \"avg_rating\":").fixed(stats.average(), 2);
+        out.raw(", \"reviews_count\":").number(stats.count);
+        extra(out);
+        out.raw('}');
+    }
+
+    /** A --get products entry: the product plus its rating summary and histogram (`stats`). */
+    void appendCatalogEntry(JsonWriter& out, const Product& p, const RatingStats& stats) const {
+        out.raw('{');
+        p.writeFields(out);
+        out.raw(", \"avg_rating\":").fixed(stats.average(), 2);
+        out.raw(", \"reviews_count\":").number(stats.count);
+        out.raw(", \"rating_histogram\":[");
+        for (size_t r = 0; r < stats.histogram.size(); ++r) {
+            if (r > 0) out.raw(',');
+            out.number(stats.histogram[r]);
+        }
+        out.raw("]}");
+    }
+
+    // --- Catalog Paging ---
+    // A page position is the sort key of a product plus its id: the average rating
+    // for sort=rating, the price for sort=price and nothing (0) for sort=id.
+    // Cursors spell it out as "<sort>:<key>:<id>" ("id:<id>" for sort=id).
+
+    struct PageKey {
+        double key;
+        int productId;
+    };
+
+    static string productCursor(const string& sort, const PageKey& last) {
+        string cursor = sort + ":";
+        if (sort != "id") {
+            char digits[32];
+            cursor.append(digits, to_chars(digits, digits + sizeof(digits), last.key).ptr); // Shortest exact form
+            cursor += ':';
+        }
+        return cursor + to_string(last.productId);
+    }
+
+    static bool parseProductCursor(const string& cursor, const string& sort, PageKey& last) {
+        if (cursor.compare(0, sort.size() + 1, sort + ":") != 0) return false;
+        const char* at = cursor.data() + sort.size() + 1;
+        const char* end = cursor.data() + cursor.size();
+        last.key = 0.0;
+        if (sort != "id") {
+            auto parsed = from_chars(at, end, last.key);
+            if (parsed.ec != errc() || parsed.ptr == end || *parsed.ptr != ':') return false;
+            at = parsed.ptr + 1;
+        }
+        auto parsed = from_chars(at, end, last.productId);
+        return parsed.ec == errc() && parsed.ptr == end;
+    }
+
+    /**
+     * sort=rating: merges the leaderboards of the selected categories (best first)
+     * from the resume point on, so a page costs about its own length plus a seek
+     * per category. Fills `page` and `total`; returns true if more products follow.
+     */
+    bool selectByRating(const ProductQuery& query, int categoryId, const PageKey* after, vector<PageKey>& page, size_t& total) const {
+        using Entry = set<RankedProduct>::const_iterator;
+        struct Head { Entry at, end; };
+        auto worse = [](const Head& a, const Head& b) { return *b.at < *a.at; }; // Best on top
+        priority_queue<Head, vector<Head>, decltype(worse)> heads(worse);
+
+        size_t first = categoryId >= 0 ? static_cast<size_t>(categoryId) : 0;
+        size_t last = categoryId >= 0 ? first + 1 : categoryLeaderboards.size();
+        for (size_t c = first; c < last; ++c) {
+            const set<RankedProduct>& board = categoryLeaderboards[c];
+            if (query.minRating <= 0.0) {
+                total += board.size();
+            } else {
+                for (const RankedProduct& entry : board) {
+                    if (entry.rating < query.minRating) break;
+                    total++;
+                }
+            }
+            Entry start = after ? board.upper_bound({after->key, after->productId}) : board.begin();
+            if (start != board.end()) heads.push({start, board.end()});
+        }
+
+        size_t skipped = 0;
+        while (!heads.empty()) {
+            Head head = heads.top();
+            heads.pop();
+            if (head.at->rating < query.minRating) continue; // The rest of this board is lower still
+            if (page.size() == query.limit) return true;
+            if (skipped < query.offset) skipped++;
+            else page.push_back({head.at->rating, head.at->productId});
+            if (++head.at != head.end) heads.push(head);
+        }
+        return false;
+    }
+
+    /**
+     * sort=id and sort=price (and sort=rating over `totals`): collects the matching
+     * products after the resume point and partially sorts just the ones up to the
+     * end of the page. Fills `page` and `total`; returns true if more products follow.
+     */
+    bool selectByKey(const ProductQuery& query, int categoryId, const PageKey* after, vector<PageKey>& page, size_t& total,
+                     const RatingTotals* totals) const {
+        bool byPrice = query.sort == "price";
+        bool byRating = query.sort == "rating";
+        auto before = [byRating](const PageKey& a, const PageKey& b) {
+            if (a.key != b.key) return byRating ? a.key > b.key : a.key < b.key; // Best rating first
+            return a.productId < b.productId;
+        };
+
+        vector<PageKey> matching;
+        auto consider = [&](const Product& p) {
+            double rating = getRatingStats(p.getId(), totals).average();
+            if (rating < query.minRating) return;
+            total++;
+            PageKey key{byPrice ? p.getPrice() : byRating ? rating : 0.0, p.getId()};
+            if (!after || before(*after, key)) matching.push_back(key);
+        };
+        if (categoryId >= 0) {
+            for (int id : categoryProducts[categoryId]) consider(*findProductById(id));
+        } else {
+            for (const Product& p : products) consider(p);
+        }
+
+        size_t start = min(query.offset, matching.size());
+        size_t stop = start + min(query.limit, matching.size() - start);
+        bool more = stop < matching.size();
+        if (more) nth_element(matching.begin(), matching.begin() + stop, matching.end(), before);
+        sort(matching.begin(), matching.begin() + stop, before);
+        page.assign(matching.begin() + start, matching.begin() + stop);
+        return more;
+    }
+
+    // --- In-Memory Mutations ---
+    // Shared by the public commands and by log replay; each keeps every index current.
+    // They return false (and change nothing) when the change does not apply.
+
+    bool applyAddUser(int id, TextRef name) {
+        if (findUserById(id)) return false;
+        users.emplace_back(id, storeText(userText, name));
+        userIndex.emplace(id, users.size() - 1);
+        nextUserId = max(nextUserId, id + 1);
+        generation++;
+        return true;
+    }
+
+    bool applyAddProduct(int id, TextRef name, const string& category, double price) {
+        if (findProductById(id)) return false;
+        products.emplace_back(id, storeText(productText, name), categoryName(category), price);
+        productIndex.emplace(id, products.size() - 1);
+        indexProductCategory(products.back());
+        categoryLeaderboards[products.back().getCategoryId()].insert({calculateAverageRating(id), id});
+        recommendationCache.invalidateCategory(products.back().getCategoryId());
+        nextProductId = max(nextProductId, id + 1);
+        generation++;
+        return true;
+    }
+
+    bool applyAddReview(int userId, int productId, int rating, TextRef comment) {
+        if (!isValidRating(rating) || !findUserById(userId) || !findProductById(productId) || hasUserReviewed(userId, productId)) return false;
+        reviews.add(userId, productId, rating, comment);
+        reviewedPairs.insert(reviewKey(userId, productId));
+        applyRating(productId, rating, true);
+        recommendationCache.invalidateUser(userId);
+        markSimilarityStale(productId);
+        generation++;
+        return true;
+    }
+
+    bool applyPurchase(int userId, int productId) {
+        if (!findUserById(userId) || !findProductById(productId)) return false;
+        purchases.add(userId, productId);
+        recommendationCache.invalidateUser(userId);
+        generation++;
+        return true;
+    }
+
+    bool applyDeleteUser(int userId) {
+        return applyDeleteUsers(vector<int>{userId}) == 1;
+    }
+
+    /**
+     * Removes the listed users along with their reviews and purchases. The reviews
+     * are found through the user index and only marked removed (the purge waits
+     * for the next compaction or save). Reviews and purchases are removed even for
+     * ids with no user row: a replayed delete may meet JSON files where the row is
+     * already gone but the dependants are not (a crash between the renames of a
+     * compaction). The user table is compacted and re-indexed once per call, which
+     * is O(users); that is why --delete-users takes the whole list in one call.
+     * Returns how many of the users existed.
+     */
+    size_t applyDeleteUsers(const vector<int>& userIds) {
+        unordered_set<int> doomed(userIds.begin(), userIds.end());
+        size_t existing = 0;
+        for (int userId : doomed) existing += userIndex.count(userId);
+        bool dependants = false;
+        for (int userId : doomed) {
+            size_t position = 0;
+            if (reviews.lastByUser(userId, position) || !purchases.ofUser(userId).empty()) { dependants = true; break; }
+        }
+        if (existing == 0 && !dependants) return 0;
+
+        // Similarity rows move for every product a deleted user reviewed; mark each once
+        if (similarityBuilt) {
+            unordered_set<int> touched;
+            for (int userId : doomed) {
+                reviews.forEachOfUser(userId, [&](size_t i) { touched.insert(reviews.productId(i)); });
+            }
+            for (int productId : touched) markSimilarityStale(productId);
+        }
+
+        for (int userId : doomed) {
+            vector<size_t> written = reviews.findByUser(userId);
+            for (size_t i : written) {
+                reviewedPairs.erase(reviewKey(userId, reviews.productId(i)));
+                applyRating(reviews.productId(i), reviews.rating(i), false);
+            }
+            reviews.removeAt(written);
+            purchases.eraseUser(userId);
+            recommendationCache.invalidateUser(userId);
+        }
+
+        if (existing > 0) {
+            users.erase(remove_if(users.begin(), users.end(), [&](const User& u) { return doomed.count(u.getId()) > 0; }), users.end());
+            rebuildUserIndex(); // Positions after the first erased user have shifted
+        }
+        generation++;
+        return existing;
+    }
+
+    /**
+     * Removes a product along with its reviews and purchases. The dependants go
+     * even if the product row is already missing, so replaying the delete over a
+     * mixed set of files (see compactData) still removes them. Returns whether
+     * the product existed.
+     */
+    bool applyDeleteProduct(int productId) {
+        auto found = productIndex.find(productId);
+        bool existed = found != productIndex.end();
+        vector<size_t> received = reviews.findByProduct(productId);
+        if (!existed && received.empty() && !purchases.boughtBySomeone(productId)) return false;
+
+        if (existed) {
+            int categoryId = products[found->second].getCategoryId();
+            vector<int>& members = categoryProducts[categoryId];
+            members.erase(find(members.begin(), members.end(), productId));
+            categoryLeaderboards[categoryId].erase({calculateAverageRating(productId), productId});
+            recommendationCache.invalidateCategory(categoryId); // Also covers users whose last review or purchase this was
+            products.erase(products.begin() + found->second);
+            rebuildProductPositions(); // Positions after the erased product have shifted
+        }
+
+        // The reviews (and their review pairs) are found through the product index
+        // and only marked removed
+        markSimilarityStale(productId);
+        for (size_t i : received) reviewedPairs.erase(reviewKey(reviews.userId(i), productId));
+        reviews.removeAt(received);
+        purchases.eraseProduct(productId);
+        ratingStats.erase(productId);
+        similarity.erase(productId);
+        generation++;
+        return existed;
+    }
+
+    /**
+     * Commits a single-change command's log line; `response` only if it is on disk, an error otherwise.
+     * Such a command logs its record exactly when it succeeds, so `succeeded` (if given) is set to
+     * whether a change was made and saved.
+     */
+    string committed(WriteLocks& locks, const string& log, const string& response, bool* succeeded = nullptr) {
+        bool saved = commitMutation(locks, log, log.empty() ? 0 : 1);
+        if (succeeded) *succeeded = saved && !log.empty();
+        return saved ? response : notSaved();
+    }
+
+    string notSaved() const {
+        return "{\"status\":\"error\", \"message\":\"Could not write " + escapeJsonString(logFile) + ", change not saved.\"}";
+    }
+
+    string dataPath(const string& filename) const {
+        return dataDir.empty() ? filename : (filesystem::path(dataDir) / filename).string();
+    }
+
+public:
+    /** A system over the data files in `dataDir`, or in the working directory by default. */
+    explicit RecommendationSystem(const string& dataDir = "")
+        : dataDir(dataDir), productsFile(dataPath(PRODUCTS_FILE)), usersFile(dataPath(USERS_FILE)),
+          reviewsFile(dataPath(REVIEWS_FILE)), purchasesFile(dataPath(PURCHASES_FILE)), logFile(dataPath(MUTATIONS_LOG_FILE)) {}
+
+    /** Threads used by the bulk rebuilds; 0 means one per hardware thread. */
+    void setThreadCount(size_t threads) { pool.setThreadCount(threads); }
+    size_t getThreadCount() const { return pool.size(); }
+
+    /** Memory budget of the --recommend reply cache, in bytes; 0 turns it off. */
+    void setRecommendationCacheBudget(size_t bytes) { recommendationCache.setBudget(bytes); }
+
+    /** Counter that changes whenever the in-memory data was reloaded or modified. */
+    unsigned long long getGeneration() const { return generation; }
+
+    /** Loads the data files now rather than on the first command. */
+    void preload() { auto reading = beginRead(); }
+
+    /** The ids the next addUser / addProduct without an explicit id would assign. */
+    int getNextUserId() { auto reading = beginRead(); return nextUserId; }
+    int getNextProductId() { auto reading = beginRead(); return nextProductId; }
+
+    /** A copy of the rating totals of every reviewed product. */
+    RatingTotals ratingTotals() {
+        auto reading = beginRead();
+        return ratingStats;
+    }
+
+    /** --stats: the process-wide counters (see Metrics) plus the current data sizes, in Prometheus text format. */
+    string getStats() {
+        DataSizes sizes = dataSizes(); // Loads first, so the counters include the load
+        JsonWriter out;
+        Metrics::writePrometheus(out);
+        writeDataSizeGauges(out, sizes);
+        return out.take();
+    }
+
+    DataSizes dataSizes() {
+        auto reading = beginRead();
+        DataSizes sizes;
+        sizes.products = products.size();
+        sizes.users = users.size();
+        sizes.reviews = reviews.size();
+        sizes.purchases = purchases.size();
+        sizes.logRecords = static_cast<size_t>(logRecords);
+        sizes.similarityRows = similarityBuilt ? products.size() - staleSimilarity.size() : 0;
+        sizes.cachedRecommendations = recommendationCache.size();
+        sizes.cacheBytes = recommendationCache.memory();
+        return sizes;
+    }
+
+    // --- JSON Getters (Read Operations) ---
+    // These write into `out`, which may pass large responses on in chunks (see JsonWriter).
+
+    // With `totals`, rating summaries come from there instead of our own reviews.
+
+    void writeProductsJson(JsonWriter& out, const RatingTotals* totals = nullptr) {
+        auto reading = beginRead(); // Latest state before generating output
+        out.reserve(products.size() * 128);
+        out.raw("{\"products\":[");
+        for (size_t i = 0; i < products.size(); ++i) {
+            appendCatalogEntry(out, products[i], getRatingStats(products[i].getId(), totals));
+            if (i < products.size() - 1) out.raw(',');
+        }
+        out.raw("]}");
+    }
+
+    /**
+     * One page of the catalog: the products matching the filters in `sort` order,
+     * starting after `cursor` and skipping `offset` more. Rating order is read off
+     * the category leaderboards (with `totals`, which the leaderboards do not
+     * reflect, it is selected like the others); id and price order select the
+     * page from the matching products without sorting the rest. Besides the products, the
+     * response holds the number of matching products ("total") and the cursor of
+     * the next page ("next_cursor", null on the last page). Ties are broken by id,
+     * so a cursor resumes at the same place however the catalog changed meanwhile.
+     */
+    void writeProductsPageJson(JsonWriter& out, const ProductQuery& query, const RatingTotals* totals = nullptr) {
+        auto reading = beginRead();
+
+        if (query.sort != "id" && query.sort != "rating" && query.sort != "price") {
+            out.raw("{\"status\":\"error\", \"message\":\"Unknown sort (id, rating, price).\"}");
+            return;
+        }
+        if (query.limit == 0) {
+            out.raw("{\"status\":\"error\", \"message\":\"Invalid limit (limit >= 1).\"}");
+            return;
+        }
+
+        // The sort key of the last product already returned; pages continue after it
+        PageKey after{0.0, 0};
+        bool resume = !query.cursor.empty();
+        if (resume && !parseProductCursor(query.cursor, query.sort, after)) {
+            out.raw("{\"status\":\"error\", \"message\":\"Invalid cursor for this sort order.\"}");
+            return;
+        }
+
+        int categoryId = -1;
+        bool knownCategory = true;
+        if (!query.category.empty()) {
+            auto it = categoryIds.find(query.category);
+            knownCategory = it != categoryIds.end();
+            if (knownCategory) categoryId = it->second;
+        }
+
+        vector<PageKey> page;
+        size_t total = 0;
+        bool more = false;
+        if (!knownCategory) {
+            // Nothing matches
+        } else if (query.sort == "rating" && !totals) {
+            more = selectByRating(query, categoryId, resume ? &after : nullptr, page, total);
+        } else {
+            more = selectByKey(query, categoryId, resume ? &after : nullptr, page, total, totals);
+        }
+
+        out.reserve(page.size() * 128 + 64);
+        out.raw("{\"products\":[");
+        for (size_t i = 0; i < page.size(); ++i) {
+            appendCatalogEntry(out, *findProductById(page[i].productId), getRatingStats(page[i].productId, totals));
+            if (i < page.size() - 1) out.raw(',');
+        }
+        out.raw("], \"total\":").number(total).raw(", \"next_cursor\":");
+        if (more && !page.empty()) out.quoted(productCursor(query.sort, page.back()));
+        else out.raw("null");
+        out.raw('}');
+    }
+
+    void writeUsersJson(JsonWriter& out) {
+        out.raw("{\"users\":[");
+        bool first = true;
+        appendUsersJson(out, first);
+        out.raw("]}");
+    }
+
+    void writeReviewsJson(JsonWriter& out, int productId) {
+        out.raw("{\"product_id\":").number(productId).raw(", \"reviews\":[");
+        bool first = true;
+        appendReviewsJson(out, productId, first);
+        out.raw("]}");
+    }
+
+    // The array elements of the two listings above, comma-separated after the
+    // first element written (`first` tracks that across calls, e.g. over shards).
+
+    void appendUsersJson(JsonWriter& out, bool& first) {
+        auto reading = beginRead(); // Latest state before generating output
+        out.reserve(users.size() * 40);
+        for (const User& user : users) {
+            if (!first) out.raw(',');
+            user.toJson(out);
+            first = false;
+        }
+    }
+
+    void appendReviewsJson(JsonWriter& out, int productId, bool& first) {
+        auto reading = beginRead();
+        reviews.forEachOfProduct(productId, [&](size_t i) {
+            if (!first) out.raw(',');
+            reviews.row(i).toJson(out);
+            first = false;
+        });
+    }
+
+    // --- JSON Adders (Create/Update Operations) ---
+    // Each command validates and applies its change under beginWrite(), then logs
+    // it. The *Locked variants do the first part for a caller that already holds
+    // the write locks (the commands themselves and runBatch) and add the change's
+    // log line to `log` when it succeeds.
+
+    // addUser and addProduct take an explicit id (0 for the next free one) when
+    // several systems share one id space, as the shards of a ShardRouter do.
+
+    string addUser(const string& name, int id = 0, bool* succeeded = nullptr) {
+        WriteLocks locks = beginWrite();
+        string log;
+        string response = addUserLocked(name, log, id);
+        return committed(locks, log, response, succeeded); // Save changes
+    }
+
+    string addProduct(const string& name, const string& category, double price, int id = 0, bool* succeeded = nullptr) {
+        WriteLocks locks = beginWrite();
+        string log;
+        string response = addProductLocked(name, category, price, log, id);
+        return committed(locks, log, response, succeeded);
+    }
+    
+    string purchaseProduct(int userId, int productId) {
+        WriteLocks locks = beginWrite();
+        string log;
+        string response = purchaseLocked(userId, productId, log);
+        return committed(locks, log, response);
+    }
+
+    string rateProduct(int userId, int productId, int rating) {
+        // Redirects to addReview as it's the persistent way to track ratings
+        return addReview(userId, productId, rating, "No comment provided.");
+    }
+
+
+    string addReview(int userId, int productId, int rating, const string& comment, bool* succeeded = nullptr) {
+        WriteLocks locks = beginWrite();
+        string log;
+        string response = addReviewLocked(userId, productId, rating, comment, log);
+        return committed(locks, log, response, succeeded);
+    }
+
+    string deleteUser(int userId) {
+        WriteLocks locks = beginWrite();
+        string log;
+        string response = deleteUserLocked(userId, log);
+        return committed(locks, log, response);
+    }
+
+    /**
+     * --delete-users: removes many users with one log record and one durable
+     * append. The ids actually deleted are also added to `deleted` if given.
+     * `succeeded` is false only if the deletes could not be saved; deleting
+     * none of the users is not a failure.
+     */
+    string deleteUsers(const vector<int>& userIds, vector<int>* deleted = nullptr, bool* succeeded = nullptr) {
+        WriteLocks locks = beginWrite();
+        string log;
+        size_t reported = deleted ? deleted->size() : 0;
+        string response = deleteUsersLocked(userIds, log, deleted);
+        bool saved = commitMutation(locks, log, log.empty() ? 0 : 1);
+        if (succeeded) *succeeded = saved;
+        if (saved) return response;
+        if (deleted) deleted->resize(reported); // Not deleted after all
+        return notSaved();
+    }
+
+    string deleteProduct(int productId, bool* succeeded = nullptr) {
+        WriteLocks locks = beginWrite();
+        string log;
+        string response = deleteProductLocked(productId, log);
+        return committed(locks, log, response, succeeded);
+    }
+
+    string addUserLocked(const string& name, string& log, int id = 0) {
+        int newId = id > 0 ? id : nextUserId;
+        if (!applyAddUser(newId, name)) return "{\"status\":\"error\", \"message\":\"User id already in use.\"}";
+        appendLogRecord(log, "add_user", toJsonString(users.back()));
+        
+        return "{\"status\":\"success\", \"message\":\"User added successfully.\", \"id\":" + to_string(newId) + ", \"name\":\"" + escapeJsonString(name) + "\"}";
+    }
+
+    string addProductLocked(const string& name, const string& category, double price, string& log, int id = 0) {
+        int newId = id > 0 ? id : nextProductId;
+        if (!applyAddProduct(newId, name, category, price)) return "{\"status\":\"error\", \"message\":\"Product id already in use.\"}";
+        appendLogRecord(log, "add_product", toJsonString(products.back()));
+
+        return "{\"status\":\"success\", \"message\":\"Product added successfully.\", \"id\":" + to_string(newId) + "}";
+    }
+
+    string addReviewLocked(int userId, int productId, int rating, const string& comment, string& log) {
+        if (findUserById(userId) == nullptr) return "{\"status\":\"error\", \"message\":\"User not found.\"}";
+        if (findProductById(productId) == nullptr) return "{\"status\":\"error\", \"message\":\"Product not found.\"}";
+        if (!isValidRating(rating)) return "{\"status\":\"error\", \"message\":\"Invalid rating (1-5).\"}";
+        
+        if (hasUserReviewed(userId, productId)) return "{\"status\":\"error\", \"message\":\"User has already reviewed this product.\"}";
+
+
+        applyAddReview(userId, productId, rating, comment);
+        appendLogRecord(log, "add_review", toJsonString(reviews.row(reviews.slots() - 1)));
+
+        return "{\"status\":\"success\", \"message\":\"Review added.\", \"product_id\":" + to_string(productId) + ", \"new_avg_rating\":" + to_string(calculateAverageRating(productId)) + "}";
+    }
+
+    string purchaseLocked(int userId, int productId, string& log) {
+        if (findUserById(userId) == nullptr) return "{\"status\":\"error\", \"message\":\"User not found.\"}";
+        if (findProductById(productId) == nullptr) return "{\"status\":\"error\", \"message\":\"Product not found.\"}";
+
+        bool repeat = purchases.contains(userId, productId);
+        applyPurchase(userId, productId);
+        appendLogRecord(log, "purchase", "{\"user_id\":" + to_string(userId) + ",\"product_id\":" + to_string(productId) + "}");
+
+        return "{\"status\":\"success\", \"message\":\"Purchase recorded.\", \"user_id\":" + to_string(userId) +
+               ", \"product_id\":" + to_string(productId) + ", \"repeat\":" + (repeat ? "true" : "false") +
+               ", \"purchased_products\":" + to_string(purchases.ofUser(userId).size()) + "}";
+    }
+
+    string deleteUserLocked(int userId, string& log) {
+        if (!findUserById(userId) || !applyDeleteUser(userId)) {
+            return "{\"status\":\"error\", \"message\":\"User not found.\"}";
+        }
+        
+        appendLogRecord(log, "delete_user", "{\"id\":" + to_string(userId) + "}");
+        return "{\"status\":\"success\", \"message\":\"User deleted successfully.\", \"id\":" + to_string(userId) + "}";
+    }
+
+    string deleteUsersLocked(const vector<int>& userIds, string& log, vector<int>* deleted = nullptr) {
+        vector<int> found;
+        for (int userId : userIds) {
+            if (findUserById(userId)) found.push_back(userId);
+        }
+        sort(found.begin(), found.end());
+        found.erase(unique(found.begin(), found.end()), found.end());
+        applyDeleteUsers(found);
+        if (deleted) deleted->insert(deleted->end(), found.begin(), found.end());
+
+        JsonWriter ids;
+        ids.raw('[');
+        for (size_t i = 0; i < found.size(); ++i) {
+            if (i > 0) ids.raw(',');
+            ids.number(found[i]);
+        }
+        ids.raw(']');
+        if (!found.empty()) appendLogRecord(log, "delete_users", "{\"ids\":" + string(ids.view()) + "}");
+        return "{\"status\":\"success\", \"message\":\"Users deleted.\", \"requested\":" + to_string(userIds.size()) +
+               ", \"deleted\":" + to_string(found.size()) + ", \"ids\":" + ids.take() + "}";
+    }
+
+    string deleteProductLocked(int productId, string& log) {
+        if (!findProductById(productId) || !applyDeleteProduct(productId)) {
+            return "{\"status\":\"error\", \"message\":\"Product not found.\"}";
+        }
+        
+        appendLogRecord(log, "delete_product", "{\"id\":" + to_string(productId) + "}");
+        return "{\"status\":\"success\", \"message\":\"Product deleted successfully.\", \"id\":" + to_string(productId) + "}";
+    }
+
+    /**
+     * --batch: runs newline-delimited JSON commands against one loaded state and
+     * writes one response line per command to `out` as it goes. Commands use the
+     * mutations.log schema without ids for adds, e.g.
+     *   {"op":"add_review","user_id":100,"product_id":1002,"rating":5,"comment":"..."}
+     *   {"op":"delete_user","id":101}
+     * The successful changes are logged in one durable append at the end, which is
+     * when they become visible to other processes; the returned summary line says
+     * how many were committed.
+     */
+    string runBatch(istream& in, ostream& out) {
+        WriteLocks locks = beginWrite();
+        string log;
+        int commands = 0, applied = 0;
+
+        string line;
+        while (getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.find_first_not_of(" \t") == string::npos) continue;
+            commands++;
+
+            MutationRecord command;
+            size_t logged = log.size();
+            string response = "{\"status\":\"error\", \"message\":\"Malformed or incomplete batch command.\"}";
+            if (command.parse(line)) {
+                const string& op = command.op;
+                if (op == "add_user" && !command.name.empty()) {
+                    response = addUserLocked(command.name, log);
+                } else if (op == "add_product" && !command.name.empty() && !command.category.empty() && command.hasPrice) {
+                    response = addProductLocked(command.name, command.category, command.price, log);
+                } else if (op == "add_review" && command.hasUser && command.hasProduct && command.hasRating) {
+                    response = addReviewLocked(command.userId, command.productId, command.rating, command.comment, log);
+                } else if (op == "delete_user" && command.hasId) {
+                    response = deleteUserLocked(command.id, log);
+                } else if (op == "delete_users" && !command.ids.empty()) {
+                    response = deleteUsersLocked(command.ids, log);
+                } else if (op == "delete_product" && command.hasId) {
+                    response = deleteProductLocked(command.id, log);
+                } else if (op == "purchase" && command.hasUser && command.hasProduct) {
+                    response = purchaseLocked(command.userId, command.productId, log);
+                }
+            }
+            if (log.size() != logged) applied++;
+            out << response << '\n';
+        }
+        out.flush();
+
+        if (!commitMutation(locks, log, applied)) {
+            return "{\"status\":\"error\", \"message\":\"Could not write " + escapeJsonString(logFile) + ", batch not committed.\"}";
+        }
+        return "{\"status\":\"success\", \"message\":\"Batch committed.\", \"commands\":" + to_string(commands) + ", \"applied\":" + to_string(applied) + "}";
+    }
+
+    /**
+     * Folds the mutation log into the JSON files now instead of waiting for the
+     * threshold. The number of records folded is also stored in `folded` if given.
+     */
+    string compact(int* folded = nullptr) {
+        WriteLocks locks = beginWrite();
+        int records = logRecords;
+        compactData(locks);
+        if (folded) *folded = records;
+        return "{\"status\":\"success\", \"message\":\"Mutation log compacted.\", \"records\":" + to_string(records) + "}";
+    }
+
+    /**
+     * --split-shards: writes the current state as `count` data directories
+     * root/shard-0 ... for --shards, which a ShardRouter serves. Every shard gets
+     * the whole catalog; users, reviews and purchases go to their shardOf() shard.
+     * `root` must be missing or empty. Our own files are left as they are. The
+     * reply lists how many users each shard received.
+     */
+    string exportShards(const string& root, size_t count) {
+        if (count < 1) return "{\"status\":\"error\", \"message\":\"Invalid shard count (n >= 1).\"}";
+        error_code ec;
+        if (filesystem::exists(root, ec) && !filesystem::is_empty(root, ec)) {
+            return "{\"status\":\"error\", \"message\":\"Shard root is not empty.\"}";
+        }
+
+        auto reading = beginRead();
+        const array<string, 4> names = {PRODUCTS_FILE, USERS_FILE, REVIEWS_FILE, PURCHASES_FILE};
+        for (size_t shard = 0; shard < count; ++shard) {
+            filesystem::path dir = filesystem::path(root) / (SHARD_DIR_PREFIX + to_string(shard));
+            filesystem::create_directories(dir, ec);
+            if (ec) return "{\"status\":\"error\", \"message\":\"Could not create shard directory.\"}";
+            array<string, 4> files = renderDataFiles(shard, count);
+            for (size_t f = 0; f < files.size(); ++f) {
+                string path = (dir / names[f]).string();
+                if (!writeTempFileContents(path, files[f]) || !replaceWithTempFile(path)) {
+                    return "{\"status\":\"error\", \"message\":\"Could not write shard files.\"}";
+                }
+            }
+            syncParentDirectory((dir / names[0]).string());
+        }
+
+        vector<size_t> placed(count, 0);
+        for (const User& user : users) placed[shardOf(user.getId(), count)]++;
+        JsonWriter out;
+        out.raw("{\"status\":\"success\", \"message\":\"Shards written.\", \"shards\":").number(count)
+           .raw(", \"root\":").quoted(root).raw(", \"users\":[");
+        for (size_t shard = 0; shard < count; ++shard) {
+            if (shard > 0) out.raw(',');
+            out.number(placed[shard]);
+        }
+        out.raw("]}");
+        return out.take();
+    }
+
+    // --- Binary Snapshots ---
+
+    /** Writes the current state (JSON files plus the log so far) as a binary snapshot. */
+    string saveSnapshot(const string& filename) {
+        // Hold off writers so the image matches the log position it records,
+        // but render under a shared lock and write the file under none
+        WriteLocks locks = beginWrite();
+        reviews.purge(); // The image holds live reviews only
+        locks.data.unlock();
+        string image;
+        {
+            shared_lock<shared_mutex> reading(dataLock);
+            image = renderSnapshot();
+        }
+
+        if (!writeFileAtomically(filename, [&image](FILE* file) { fwrite(image.data(), 1, image.size(), file); })) {
+            return "{\"status\":\"error\", \"message\":\"Could not write snapshot.\"}";
+        }
+        return "{\"status\":\"success\", \"message\":\"Snapshot saved.\", \"file\":\"" + escapeJsonString(filename) + "\", \"bytes\":" + to_string(image.size()) + "}";
+    }
+
+    /** The binary snapshot image of the current state (see SnapshotHeader). Needs purged reviews. */
+    string renderSnapshot() const {
+        SnapshotWriter writer;
+        vector<int32_t> ids, categories;
+        vector<double> prices;
+
+        for (const auto& p : products) {
+            ids.push_back(p.getId());
+            prices.push_back(p.getPrice());
+            categories.push_back(p.getCategoryId());
+            writer.addString(p.getName());
+        }
+        writer.column(ids);
+        writer.column(prices);
+        writer.column(categories);
+        for (const auto& name : categoryNames) writer.addString(name);
+
+        ids.clear();
+        for (const auto& u : users) {
+            ids.push_back(u.getId());
+            writer.addString(u.getName());
+        }
+        writer.column(ids);
+
+        // Review columns are already laid out as the snapshot wants them
+        for (size_t i = 0; i < reviews.slots(); ++i) writer.addString(reviews.comment(i));
+        writer.column(reviews.userIdColumn());
+        writer.column(reviews.productIdColumn());
+        writer.column(reviews.ratingColumn());
+
+        // Purchases as (user, product) columns, each user's in purchase order
+        vector<int32_t> purchaseUsers, purchaseProducts;
+        purchaseUsers.reserve(purchases.size());
+        purchaseProducts.reserve(purchases.size());
+        purchases.forEachUser([&](int userId, const vector<int>& productIds) {
+            purchaseUsers.insert(purchaseUsers.end(), productIds.size(), userId);
+            purchaseProducts.insert(purchaseProducts.end(), productIds.begin(), productIds.end());
+        });
+        writer.column(purchaseUsers);
+        writer.column(purchaseProducts);
+
+        SnapshotHeader header{};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        header.nextProductId = nextProductId;
+        header.nextUserId = nextUserId;
+        header.productCount = products.size();
+        header.categoryCount = categoryNames.size();
+        header.userCount = users.size();
+        header.reviewCount = reviews.slots();
+        header.purchaseCount = purchaseUsers.size();
+        header.productsStamp = SnapshotStamp::from(productsStamp);
+        header.usersStamp = SnapshotStamp::from(usersStamp);
+        header.reviewsStamp = SnapshotStamp::from(reviewsStamp);
+        header.purchasesStamp = SnapshotStamp::from(purchasesStamp);
+        header.logOffset = logOffset;
+        header.logRecords = logRecords;
+        return writer.finish(header);
+    }
+
+    /**
+     * Replaces the in-memory state with a binary snapshot. Text fields point into
+     * the mapped snapshot and the indexes are rebuilt from the columns, so nothing
+     * is parsed. The snapshot remembers the JSON file stamps and log position it was
+     * taken at; the next refreshData() reloads whatever changed since and replays
+     * newer log records, exactly as if the snapshot's state had been read normally.
+     * `succeeded` (if given) is set to whether the snapshot was used.
+     */
+    string loadSnapshot(const string& filename, bool* succeeded = nullptr) {
+        if (succeeded) *succeeded = false;
+        unique_lock<mutex> writer(writerLock);
+        unique_lock<shared_mutex> data(dataLock);
+        products.clear();
+        users.clear();
+        reviews.clear();
+        purchases.clear();
+        productText.clear();
+        userText.clear();
+        loaded = false; // On failure the next refreshData() falls back to the JSON files
+
+        const string invalid = "{\"status\":\"error\", \"message\":\"Invalid or unreadable snapshot.\"}";
+        if (!snapshotMapping.open(filename)) return invalid;
+
+        SnapshotReader reader(snapshotMapping.view());
+        SnapshotHeader header;
+        if (!reader.header(header) || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != SNAPSHOT_VERSION || header.byteOrder != SNAPSHOT_BYTE_ORDER) {
+            return invalid;
+        }
+
+        vector<int32_t> productIdColumn, categoryColumn, userIdColumn, reviewUserColumn, reviewProductColumn;
+        vector<int32_t> purchaseUserColumn, purchaseProductColumn;
+        vector<double> priceColumn;
+        vector<uint8_t> ratingColumn;
+        vector<uint64_t> stringEnds;
+        reader.column(productIdColumn, header.productCount);
+        reader.column(priceColumn, header.productCount);
+        reader.column(categoryColumn, header.productCount);
+        reader.column(userIdColumn, header.userCount);
+        reader.column(reviewUserColumn, header.reviewCount);
+        reader.column(reviewProductColumn, header.reviewCount);
+        reader.column(ratingColumn, header.reviewCount);
+        reader.column(purchaseUserColumn, header.purchaseCount);
+        reader.column(purchaseProductColumn, header.purchaseCount);
+        reader.column(stringEnds, header.productCount + header.categoryCount + header.userCount + header.reviewCount);
+        string_view table = reader.rest(header.stringBytes);
+        for (size_t i = 1; reader.ok() && i < stringEnds.size(); ++i) {
+            if (stringEnds[i] < stringEnds[i - 1]) return invalid;
+        }
+        if (!reader.ok() || (!stringEnds.empty() && stringEnds.back() != table.size())) return invalid;
+        for (int32_t c : categoryColumn) {
+            if (c < 0 || static_cast<uint64_t>(c) >= header.categoryCount) return invalid;
+        }
+
+        size_t nextString = 0;
+        auto text = [&]() {
+            uint64_t start = nextString == 0 ? 0 : stringEnds[nextString - 1];
+            uint64_t end = stringEnds[nextString++];
+            return table.substr(static_cast<size_t>(start), static_cast<size_t>(end - start));
+        };
+
+        vector<string_view> productNames;
+        productNames.reserve(productIdColumn.size());
+        for (size_t i = 0; i < productIdColumn.size(); ++i) productNames.push_back(text());
+        vector<string_view> snapshotCategories;
+        snapshotCategories.reserve(static_cast<size_t>(header.categoryCount));
+        for (uint64_t i = 0; i < header.categoryCount; ++i) snapshotCategories.push_back(categoryName(text()));
+
+        products.reserve(productIdColumn.size());
+        for (size_t i = 0; i < productIdColumn.size(); ++i) {
+            products.emplace_back(productIdColumn[i], productNames[i], snapshotCategories[categoryColumn[i]], priceColumn[i]);
+        }
+        users.reserve(userIdColumn.size());
+        for (int32_t id : userIdColumn) users.emplace_back(id, text());
+        reviews.reserve(reviewUserColumn.size());
+        for (size_t i = 0; i < reviewUserColumn.size(); ++i) {
+            TextRef comment = TextRef::borrow(text()); // Read even when skipped, the texts are sequential
+            if (isValidRating(ratingColumn[i])) reviews.add(reviewUserColumn[i], reviewProductColumn[i], ratingColumn[i], comment);
+        }
+        for (size_t i = 0; i < purchaseUserColumn.size(); ++i) purchases.add(purchaseUserColumn[i], purchaseProductColumn[i]);
+
+        nextProductId = header.nextProductId;
+        nextUserId = header.nextUserId;
+        rebuildProductIndex();
+        rebuildUserIndex();
+        rebuildReviewIndex();
+        rebuildRatingStats();
+        rebuildLeaderboards();
+        invalidateSimilarity();
+        recommendationCache.clear();
+
+        productsStamp = header.productsStamp.toFileStamp();
+        usersStamp = header.usersStamp.toFileStamp();
+        reviewsStamp = header.reviewsStamp.toFileStamp();
+        purchasesStamp = header.purchasesStamp.toFileStamp();
+        logOffset = static_cast<uintmax_t>(header.logOffset);
+        logRecords = static_cast<int>(header.logRecords);
+        loaded = true;
+        generation++;
+
+        if (succeeded) *succeeded = true;
+        return "{\"status\":\"success\", \"message\":\"Snapshot loaded.\", \"products\":" + to_string(products.size()) +
+               ", \"users\":" + to_string(users.size()) + ", \"reviews\":" + to_string(reviews.size()) + ", \"purchases\":" + to_string(purchases.size()) + "}";
+    }
+    
+    /** Served from recommendationCache when nothing it depends on has changed since it was computed. */
+    string getRecommendationsJson(int userId, int k = DEFAULT_RECOMMENDATIONS) {
+        auto reading = beginRead();
+        string cached;
+        if (recommendationCache.lookup(userId, k, cached)) {
+            Metrics::add(RECOMMENDATIONS_CATEGORY);
+            return cached;
+        }
+        JsonWriter out;
+        int categoryId = recommendationsLocked(out, userId, k);
+        string json = out.take();
+        if (categoryId >= 0) recommendationCache.store(userId, k, categoryId, json);
+        return json;
+    }
+
+    /** Category recommendations ranked by `merged` instead of our own reviews (see ShardRouter). */
+    void writeRecommendationsJson(JsonWriter& out, int userId, int k, const MergedRatings& merged) {
+        auto reading = beginRead();
+        recommendationsLocked(out, userId, k, &merged);
+    }
+
+    /** Item-item CF recommendations (see itemCfRecommendationsLocked). */
+    string getItemCfRecommendationsJson(int userId, int k = DEFAULT_RECOMMENDATIONS) {
+        auto reading = beginRead(true);
+        JsonWriter out;
+        itemCfRecommendationsLocked(out, userId, k);
+        return out.take();
+    }
+
+    /**
+     * --recommend-all / --recommend-users: one recommendation line per user (all
+     * users in id order when `userIds` is null), written to `out` as NDJSON. All
+     * users share one load and one read lock; each block of users is computed on
+     * the thread pool and written in order before the next one starts. Returns the
+     * summary line. `strategy` must be "category" or "itemcf". If a block throws,
+     * none of its lines are written and the exception reaches the caller, which
+     * ends the output with an error summary instead.
+     */
+    string recommendForUsers(const vector<int>* userIds, int k, const string& strategy, ostream& out) {
+        bool itemCf = strategy == "itemcf";
+        auto reading = beginRead(itemCf);
+
+        vector<int> everyone;
+        if (!userIds) {
+            everyone.reserve(users.size());
+            for (const User& user : users) everyone.push_back(user.getId());
+            sort(everyone.begin(), everyone.end());
+            userIds = &everyone;
+        }
+
+        // Line buffers are reused from block to block
+        const size_t block = 4096;
+        vector<JsonWriter> lines(min(block, userIds->size()));
+        for (size_t start = 0; start < userIds->size(); start += block) {
+            size_t count = min(block, userIds->size() - start);
+            pool.parallelFor(count, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    int userId = (*userIds)[start + i];
+                    lines[i].clear();
+                    if (itemCf) itemCfRecommendationsLocked(lines[i], userId, k);
+                    else recommendationsLocked(lines[i], userId, k);
+                    lines[i].raw('\n');
+                }
+            });
+            for (size_t i = 0; i < count; ++i) out << lines[i].view();
+        }
+        out.flush();
+
+        return "{\"status\":\"success\", \"message\":\"Recommendations generated.\", \"users\":" + to_string(userIds->size()) + ", \"strategy\":\"" + strategy + "\"}";
+    }
+
+    /**
+     * Category recommendations for one user; the caller holds a read lock. With
+     * `merged` the category is ranked by its merged leaderboard, which the
+     * first shard to need it builds from its catalog. Returns the target category's id, or -1 if the reply is an error.
+     */
+    int recommendationsLocked(JsonWriter& out, int userId, int k, const MergedRatings* merged = nullptr) const {
+        MetricTimer timer(RECOMMENDATION_NS_CATEGORY);
+        Metrics::add(RECOMMENDATIONS_CATEGORY);
+        if (k < 1) { out.raw("{\"status\":\"error\", \"message\":\"Invalid recommendation count (k >= 1).\"}"); return -1; }
+        
+        const User* user = findUserById(userId);
+        if (!user) { out.raw("{\"status\":\"error\", \"message\":\"User not found.\"}"); return -1; }
+
+        // 1. Find the category of the last reviewed product, or else of the last purchase
+        size_t lastReview = 0;
+        const vector<int>& bought = purchases.ofUser(userId);
+        int lastReviewedId = 0;
+        if (reviews.lastByUser(userId, lastReview)) lastReviewedId = reviews.productId(lastReview);
+        else if (!bought.empty()) lastReviewedId = bought.back();
+        else {
+            out.raw("{\"status\":\"error\", \"message\":\"User has no review or purchase history for recommendations.\"}");
+            return -1;
+        }
+
+        const Product* lastProduct = findProductById(lastReviewedId);
+        if (!lastProduct) { out.raw("{\"status\":\"error\", \"message\":\"Internal data error: Last reviewed product missing.\"}"); return -1; }
+
+        string_view targetCategory = lastProduct->getCategory();
+
+        // 2. Walk the category leaderboard (best first), skipping products the user
+        //    already reviewed or bought, until k recommendations are found
+        vector<RankedProduct> top;
+        size_t walked = 0;
+        auto walk = [&](const auto& ranked, auto&& listed) {
+            for (const RankedProduct& entry : ranked) {
+                if (top.size() == static_cast<size_t>(k)) break;
+                if (!listed(entry)) continue;
+                walked++;
+                if (!hasUserReviewed(userId, entry.productId) && !purchases.contains(userId, entry.productId)) top.push_back(entry);
+            }
+        };
+        const RatingTotals* totals = merged ? &merged->totals : nullptr;
+        if (merged) {
+            const vector<RankedProduct>& ranked = merged->leaderboard(targetCategory, [&]() {
+                vector<RankedProduct> unsorted;
+                for (int productId : categoryProducts[lastProduct->getCategoryId()]) {
+                    unsorted.push_back({getRatingStats(productId, totals).average(), productId});
+                }
+                return unsorted;
+            });
+            // Maybe built by another shard, whose catalog can be a product add or delete ahead of ours
+            auto listed = [this](const RankedProduct& entry) { return findProductById(entry.productId) != nullptr; };
+            walk(ranked, listed);
+        } else {
+            walk(categoryLeaderboards[lastProduct->getCategoryId()], [](const RankedProduct&) { return true; });
+        }
+        Metrics::add(CANDIDATES_CATEGORY, walked);
+
+        if (top.empty()) {
+            out.raw("{\"status\":\"success\", \"user_id\":").number(userId)
+               .raw(", \"recommendations\":[], \"message\":\"No new recommendations available in category ")
+               .escaped(targetCategory).raw(".\"}");
+            return lastProduct->getCategoryId();
+        }
+
+        // 3. Build JSON for the top k recommendations
+        out.raw("{\"status\":\"success\",\"user_id\":").number(userId)
+           .raw(",\"target_category\":").quoted(targetCategory)
+           .raw(",\"recommendations\":[");
+        
+        for (size_t i = 0; i < top.size(); ++i) {
+            appendRecommendation(out, top[i].productId, getRatingStats(top[i].productId, totals), [](JsonWriter&) {});
+            if (i < top.size() - 1) out.raw(',');
+        }
+        out.raw("]}");
+        return lastProduct->getCategoryId();
+    }
+
+    /**
+     * Item-based collaborative filtering: every product the user reviewed votes for
+     * its stored neighbours with similarity * the user's rating, and every product
+     * they bought without reviewing votes as if rated PURCHASE_IMPLICIT_RATING.
+     * Products the user already reviewed or bought are skipped; the k highest total scores are returned, along
+     * with the similarity-weighted rating prediction. The caller holds a read lock
+     * taken with beginRead(true).
+     */
+    void itemCfRecommendationsLocked(JsonWriter& out, int userId, int k) const {
+        MetricTimer timer(RECOMMENDATION_NS_ITEMCF);
+        Metrics::add(RECOMMENDATIONS_ITEMCF);
+        if (k < 1) { out.raw("{\"status\":\"error\", \"message\":\"Invalid recommendation count (k >= 1).\"}"); return; }
+        
+        const User* user = findUserById(userId);
+        if (!user) { out.raw("{\"status\":\"error\", \"message\":\"User not found.\"}"); return; }
+
+        size_t lastReview = 0;
+        const vector<int>& bought = purchases.ofUser(userId);
+        if (!reviews.lastByUser(userId, lastReview) && bought.empty()) {
+            out.raw("{\"status\":\"error\", \"message\":\"User has no review or purchase history for recommendations.\"}");
+            return;
+        }
+
+        // The user's own products, sorted, stand in for hasUserReviewed(): a few
+        // hundred votes are checked per user, and probing the global pair set for
+        // each one dominates --recommend-all
+        vector<int> reviewed;
+        reviews.forEachOfUser(userId, [&](size_t q) { reviewed.push_back(reviews.productId(q)); });
+        sort(reviewed.begin(), reviewed.end());
+        size_t reviewedCount = reviewed.size();
+        for (int productId : bought) {
+            if (!binary_search(reviewed.begin(), reviewed.begin() + reviewedCount, productId)) reviewed.push_back(productId);
+        }
+        vector<int> boughtOnly(reviewed.begin() + reviewedCount, reviewed.end()); // In purchase order
+        sort(reviewed.begin(), reviewed.end());
 
-        // 4. Build JSON for top 3 recommendations
-        ostringstream oss;
-        oss << "{"
-            << "\"status\":\"success\","
-            << "\"user_id\":" << userId << ","
-            << "\"target_category\":\"" << targetCategory << "\","
-            << "\"recommendations\":[";
-        
-        int count = 0;
-        for (const auto& candidate : candidates) {
-            if (count < 3) {
-                // Manually construct JSON to include the rating
-                string product_json_base = candidate.second->toJson();
-                product_json_base.pop_back(); 
-                
-                oss << product_json_base; 
-                oss << ", \"avg_rating\":" << fixed << setprecision(2) << candidate.first;
-                oss << ", \"reviews_count\":" << count_if(reviews.begin(), reviews.end(), 
-                                      [&candidate](const Review& r){ return r.getProductId() == candidate.second->getId(); });
-                oss << "}";
-
-                if (count < 2 && count < candidates.size() - 1) oss << ",";
-                count++;
-            } else {
-                break;
-            }
+        struct Candidate { int productId; double score; double weight; };
+        vector<Candidate> votes;
+        auto vote = [&](int productId, int rating) {
+            similarity.forEach(productId, [&](const Neighbour& n) {
+                if (binary_search(reviewed.begin(), reviewed.end(), n.productId)) return;
+                votes.push_back({n.productId, static_cast<double>(n.similarity) * rating, static_cast<double>(n.similarity)});
+            });
+        };
+        reviews.forEachOfUser(userId, [&](size_t q) { vote(reviews.productId(q), reviews.rating(q)); });
+        for (int productId : boughtOnly) vote(productId, PURCHASE_IMPLICIT_RATING);
+
+        // Sum the votes per product, in the order they were cast
+        stable_sort(votes.begin(), votes.end(), [](const Candidate& a, const Candidate& b) { return a.productId < b.productId; });
+        vector<Candidate> candidates;
+        for (const Candidate& vote : votes) {
+            if (candidates.empty() || candidates.back().productId != vote.productId) candidates.push_back({vote.productId, 0.0, 0.0});
+            candidates.back().score += vote.score;
+            candidates.back().weight += vote.weight;
+        }
+        Metrics::add(CANDIDATES_ITEMCF, candidates.size());
+
+        size_t keep = min(candidates.size(), static_cast<size_t>(k));
+        partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.score != b.score ? a.score > b.score : a.productId < b.productId;
+        });
+        candidates.resize(keep);
+
+        if (candidates.empty()) {
+            out.raw("{\"status\":\"success\", \"user_id\":").number(userId)
+               .raw(", \"strategy\":\"itemcf\", \"recommendations\":[], \"message\":\"No similar products found for this user.\"}");
+            return;
+        }
+
+        out.raw("{\"status\":\"success\",\"user_id\":").number(userId)
+           .raw(",\"strategy\":\"itemcf\",\"recommendations\":[");
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            const Candidate& c = candidates[i];
+            appendRecommendation(out, c.productId, getRatingStats(c.productId), [&c](JsonWriter& extra) {
+                extra.raw(", \"score\":").fixed(c.score, 4);
+                extra.raw(", \"predicted_rating\":").fixed(c.weight > 0.0 ? c.score / c.weight : 0.0, 2);
+            });
+            if (i < candidates.size() - 1) out.raw(',');
         }
-        oss << "]}";
-        return oss.str();
+        out.raw("]}");
     }
 };
 
-// --- MAIN ENTRY POINT ---
-int main(int argc, char* argv[]) {
-    ios_base::sync_with_stdio(false);
-    cin.tie(NULL);
+/** Parses an `id,id,...` argument (empty entries are skipped; stoi throws on bad ones). */
+vector<int> parseIdList(const string& list) {
+    vector<int> ids;
+    stringstream entries(list);
+    string id;
+    while (getline(entries, id, ',')) {
+        if (!id.empty()) ids.push_back(stoi(id));
+    }
+    return ids;
+}
 
-    RecommendationSystem system;
+// --- 5. ShardRouter Class ---
+// `--shards <root>` serves a data root written by --split-shards: one
+// RecommendationSystem per directory root/shard-0, root/shard-1, ... Users are
+// placed by shardOf(user id), and each user's reviews and purchases live on the
+// same shard. Every shard holds the whole catalog, so product changes go to all
+// of them. The router has the command interface of RecommendationSystem that
+// executeCommand() uses; it fans the catalog listings and the category ranking
+// out over the shards and merges the rating totals, so those answers match an
+// unsharded engine over the same data.
 
-    if (argc < 2) {
-        cout << "{\"error\": \"No command provided. Usage: ./main <command> [args...]\"}" << endl;
-        return 1;
+class ShardRouter {
+private:
+    vector<unique_ptr<RecommendationSystem>> shards;
+
+    // Rating totals summed over the shards and their leaderboards, cached until a shard's generation moves
+    mutex totalsLock;
+    shared_ptr<const MergedRatings> totals;
+    vector<unsigned long long> totalsGenerations;
+
+    mutex addLock; // Serializes id assignment for adds made through this router
+
+    RecommendationSystem& home(int userId) { return *shards[shardOf(userId, shards.size())]; }
+    RecommendationSystem& catalog() { return *shards[0]; }
+
+    shared_ptr<const MergedRatings> mergedTotals() {
+        vector<unsigned long long> generations;
+        for (auto& shard : shards) {
+            shard->preload(); // Picks up changes other processes made to its files
+            generations.push_back(shard->getGeneration());
+        }
+        lock_guard<mutex> guard(totalsLock);
+        if (totals && generations == totalsGenerations) return totals;
+
+        auto merged = make_shared<MergedRatings>();
+        for (auto& shard : shards) {
+            for (const auto& entry : shard->ratingTotals()) merged->totals[entry.first].merge(entry.second);
+        }
+        totals = merged;
+        totalsGenerations = move(generations); // Read before merging, so a change made meanwhile re-merges next time
+        return totals;
+    }
+
+    static string unsupported(const char* command) {
+        return string("{\"status\":\"error\", \"message\":\"") + command + " is not supported with --shards.\"}";
+    }
+
+public:
+    /** Opens the shard directories under `root`; size() is 0 if there are none. */
+    explicit ShardRouter(const string& root) {
+        error_code ec;
+        for (size_t i = 0;; ++i) {
+            filesystem::path dir = filesystem::path(root) / (SHARD_DIR_PREFIX + to_string(i));
+            if (!filesystem::is_directory(dir, ec)) break;
+            shards.push_back(make_unique<RecommendationSystem>(dir.string()));
+        }
+    }
+
+    size_t size() const { return shards.size(); }
+
+    /** Splits `threads` (0 = one per hardware thread) between the shards' rebuild pools. */
+    void setThreadCount(size_t threads) {
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        size_t each = max<size_t>(1, threads / shards.size());
+        for (auto& shard : shards) shard->setThreadCount(each);
+    }
+    size_t getThreadCount() const { return shards.size() * shards[0]->getThreadCount(); }
+
+    /** Loads every shard, in parallel. */
+    void preload() {
+        vector<thread> loaders;
+        for (auto& shard : shards) loaders.emplace_back([&shard]() { shard->preload(); });
+        for (auto& t : loaders) t.join();
+    }
+
+    // --- Reads ---
+
+    void writeProductsJson(JsonWriter& out) { auto merged = mergedTotals(); catalog().writeProductsJson(out, &merged->totals); }
+
+    void writeProductsPageJson(JsonWriter& out, const ProductQuery& query) {
+        auto merged = mergedTotals();
+        catalog().writeProductsPageJson(out, query, &merged->totals);
+    }
+
+    // The listings below render each shard's part into a buffer under that shard's
+    // read lock and stream it after the lock is released. So no two shard locks are
+    // ever held together, and a slow client never keeps a shard's writers waiting.
+
+    /** Users grouped by shard, each shard's in its own order. */
+    void writeUsersJson(JsonWriter& out) {
+        out.raw("{\"users\":[");
+        bool first = true;
+        JsonWriter part;
+        for (auto& shard : shards) {
+            part.clear();
+            shard->appendUsersJson(part, first);
+            out.raw(part.view());
+        }
+        out.raw("]}");
+    }
+
+    void writeReviewsJson(JsonWriter& out, int productId) {
+        out.raw("{\"product_id\":").number(productId).raw(", \"reviews\":[");
+        bool first = true;
+        JsonWriter part;
+        for (auto& shard : shards) {
+            part.clear();
+            shard->appendReviewsJson(part, productId, first);
+            out.raw(part.view());
+        }
+        out.raw("]}");
+    }
+
+    /** The user's history is all on their home shard; the category is ranked by the merged totals. */
+    string getRecommendationsJson(int userId, int k = DEFAULT_RECOMMENDATIONS) {
+        auto merged = mergedTotals();
+        JsonWriter out;
+        home(userId).writeRecommendationsJson(out, userId, k, *merged);
+        return out.take();
+    }
+
+    /**
+     * Item-item CF on the user's home shard only: its similarity rows are built
+     * from that shard's co-ratings, so they approximate the global ones (the
+     * sample is 1/size() of the users).
+     */
+    string getItemCfRecommendationsJson(int userId, int k = DEFAULT_RECOMMENDATIONS) {
+        return home(userId).getItemCfRecommendationsJson(userId, k);
+    }
+
+    /** --stats: the process-wide counters plus the data sizes summed over the shards. */
+    string getStats() {
+        DataSizes total; // Summed before the counters are written, so those include every shard's load
+        for (auto& shard : shards) {
+            DataSizes sizes = shard->dataSizes();
+            total.users += sizes.users;
+            total.reviews += sizes.reviews;
+            total.purchases += sizes.purchases;
+            total.logRecords += sizes.logRecords;
+            total.similarityRows += sizes.similarityRows;
+            total.cachedRecommendations += sizes.cachedRecommendations;
+            total.cacheBytes += sizes.cacheBytes;
+        }
+        total.products = catalog().dataSizes().products; // Replicated, so counted once
+        JsonWriter out;
+        Metrics::writePrometheus(out);
+        writeDataSizeGauges(out, total);
+        return out.take();
+    }
+
+    // --- Writes ---
+
+    /** Takes the next id free on every shard and adds the user on its home shard. */
+    string addUser(const string& name) {
+        lock_guard<mutex> guard(addLock);
+        string response;
+        for (int attempt = 0; attempt < 8; ++attempt) {
+            int id = 0;
+            for (auto& shard : shards) id = max(id, shard->getNextUserId());
+            bool added = false;
+            response = home(id).addUser(name, id, &added);
+            if (added || home(id).getNextUserId() <= id) break; // Else another process took the id
+        }
+        return response;
+    }
+
+    /** Adds the product with the same id on every shard; the reply is shard 0's, or the first failing shard's. */
+    string addProduct(const string& name, const string& category, double price) {
+        lock_guard<mutex> guard(addLock);
+        int id = 0;
+        for (auto& shard : shards) id = max(id, shard->getNextProductId());
+        string response;
+        bool failed = false;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            bool ok = false;
+            string added = shards[i]->addProduct(name, category, price, id, &ok);
+            if (i == 0 || (!ok && !failed)) response = added;
+            failed = failed || !ok;
+        }
+        return response;
+    }
+
+    /** Deleted on every shard; the reply is shard 0's, or the first failing shard's. */
+    string deleteProduct(int productId) {
+        string response;
+        bool failed = false;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            bool ok = false;
+            string deleted = shards[i]->deleteProduct(productId, &ok);
+            if (i == 0 || (!ok && !failed)) response = deleted;
+            failed = failed || !ok;
+        }
+        return response;
+    }
+
+    string purchaseProduct(int userId, int productId) { return home(userId).purchaseProduct(userId, productId); }
+    string rateProduct(int userId, int productId, int rating) { return addReview(userId, productId, rating, "No comment provided."); }
+
+    /** Added on the reviewer's home shard; the new average in the reply is over all shards. */
+    string addReview(int userId, int productId, int rating, const string& comment) {
+        bool added = false;
+        string response = home(userId).addReview(userId, productId, rating, comment, &added);
+        if (!added) return response;
+        auto merged = mergedTotals();
+        auto it = merged->totals.find(productId);
+        double average = it != merged->totals.end() ? it->second.average() : 0.0;
+        return "{\"status\":\"success\", \"message\":\"Review added.\", \"product_id\":" + to_string(productId) + ", \"new_avg_rating\":" + to_string(average) + "}";
     }
+    string deleteUser(int userId) { return home(userId).deleteUser(userId); }
 
-    string command = argv[1];
+    /**
+     * One bulk delete per shard that holds any of the users; the reply merges
+     * theirs. If a shard could not save its deletes the reply is an error, still
+     * listing the ids the other shards did delete.
+     */
+    string deleteUsers(const vector<int>& userIds) {
+        vector<vector<int>> byShard(shards.size());
+        for (int userId : userIds) byShard[shardOf(userId, shards.size())].push_back(userId);
+        vector<int> deleted;
+        bool saved = true;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            bool ok = true;
+            if (!byShard[i].empty()) shards[i]->deleteUsers(byShard[i], &deleted, &ok);
+            saved = saved && ok;
+        }
+        sort(deleted.begin(), deleted.end());
+
+        JsonWriter out;
+        out.raw(saved ? "{\"status\":\"success\", \"message\":\"Users deleted.\""
+                      : "{\"status\":\"error\", \"message\":\"Some shards could not save their deletes.\"")
+           .raw(", \"requested\":").number(userIds.size())
+           .raw(", \"deleted\":").number(deleted.size()).raw(", \"ids\":[");
+        for (size_t i = 0; i < deleted.size(); ++i) {
+            if (i > 0) out.raw(',');
+            out.number(deleted[i]);
+        }
+        out.raw("]}");
+        return out.take();
+    }
+
+    /** Compacts every shard; "records" counts the log records folded on all of them. */
+    string compact() {
+        int records = 0;
+        for (auto& shard : shards) {
+            int folded = 0;
+            shard->compact(&folded);
+            records += folded;
+        }
+        return "{\"status\":\"success\", \"message\":\"Mutation log compacted.\", \"records\":" + to_string(records) +
+               ", \"shards\":" + to_string(shards.size()) + "}";
+    }
+
+    string saveSnapshot(const string&) { return unsupported("--snapshot-save"); }
+    string loadSnapshot(const string&) { return unsupported("--snapshot-load"); }
+};
+
+// --- COMMAND DISPATCH ---
+
+/**
+ * Runs one CLI-style command (program name excluded) against the given system
+ * (a RecommendationSystem, or a ShardRouter for --shards).
+ * Writes the JSON response to `out` and returns the exit code for it. The large
+ * listings (--get ...) stream through `out` as they are produced; the other
+ * responses are small and written in one piece.
+ *
+ * A listing that fails before any of it reached the stream is replaced by the
+ * error object, as for any other command. One that fails after a chunk was sent
+ * cannot be taken back: its cut-off line is ended and followed by the error
+ * object on a line of its own, marked "truncated":true. So a client reading a
+ * streamed reply that does not parse takes the next line as its error.
+ */
+template <typename System>
+int executeCommand(System& system, const vector<string>& args, JsonWriter& out) {
     string output_json = "{\"error\": \"Invalid command or missing parameters.\"}";
+    bool streamed = false; // The response went straight to `out`
+    size_t start = out.size(); // `out` may already hold a reply prefix (serve mode tags)
+    size_t flushedBefore = out.flushed();
+    if (args.empty()) {
+        out.raw(output_json);
+        return 1;
+    }
+
+    const string& command = args[0];
+    const size_t argc = args.size();
     int exit_code = 1;
 
     try {
-        if (command == "--get" && argc == 3) {
+        if (command == "--get" && argc == 2) {
             // --get products | --get users
-            string resource = argv[2];
-            if (resource == "products") { output_json = system.getProductsJson(); exit_code = 0; } 
-            else if (resource == "users") { output_json = system.getUsersJson(); exit_code = 0; }
+            const string& resource = args[1];
+            if (resource == "products") { streamed = true; system.writeProductsJson(out); exit_code = 0; } 
+            else if (resource == "users") { streamed = true; system.writeUsersJson(out); exit_code = 0; }
+        }
+        else if (command == "--get" && argc >= 4 && argc % 2 == 0 && args[1] == "products") {
+            // --get products [--offset N] [--limit M] [--category C] [--min-rating R]
+            //                [--sort id|rating|price] [--cursor <next_cursor>]
+            auto count = [](const string& value) {
+                long long parsed = stoll(value);
+                if (parsed < 0) throw invalid_argument("negative offset or limit");
+                return static_cast<size_t>(parsed);
+            };
+            ProductQuery query;
+            bool known = true;
+            for (size_t i = 2; i < argc; i += 2) {
+                const string& option = args[i];
+                const string& value = args[i + 1];
+                if (option == "--offset") query.offset = count(value);
+                else if (option == "--limit") query.limit = count(value);
+                else if (option == "--category") query.category = value;
+                else if (option == "--min-rating") query.minRating = stod(value);
+                else if (option == "--sort") query.sort = value;
+                else if (option == "--cursor") query.cursor = value;
+                else known = false;
+            }
+            if (known) { streamed = true; system.writeProductsPageJson(out, query); exit_code = 0; }
         }
-        else if (command == "--get" && argc == 4 && string(argv[2]) == "reviews") {
+        else if (command == "--get" && argc == 3 && args[1] == "reviews") {
             // --get reviews <product_id>
-            output_json = system.getReviewsJson(stoi(argv[3]));
+            int productId = stoi(args[2]);
+            streamed = true;
+            system.writeReviewsJson(out, productId);
             exit_code = 0;
         }
-        else if (command == "--add-user" && argc == 3) {
+        else if (command == "--add-user" && argc == 2) {
             // --add-user <name>
-            output_json = system.addUser(argv[2]);
+            output_json = system.addUser(args[1]);
             exit_code = 0;
         }
-        else if (command == "--add-product" && argc == 5) {
+        else if (command == "--add-product" && argc == 4) {
             // --add-product <name> <category> <price>
-            output_json = system.addProduct(argv[2], argv[3], stod(argv[4]));
+            output_json = system.addProduct(args[1], args[2], stod(args[3]));
             exit_code = 0;
         }
-        else if (command == "--purchase" && argc == 4) {
+        else if (command == "--purchase" && argc == 3) {
             // --purchase <userId> <productId>
-            output_json = system.purchaseProduct(stoi(argv[2]), stoi(argv[3]));
+            output_json = system.purchaseProduct(stoi(args[1]), stoi(args[2]));
             exit_code = 0;
         }
-        else if (command == "--rate" && argc == 5) {
+        else if (command == "--rate" && argc == 4) {
             // --rate <userId> <productId> <rating>
-            output_json = system.rateProduct(stoi(argv[2]), stoi(argv[3]), stoi(argv[4]));
+            output_json = system.rateProduct(stoi(args[1]), stoi(args[2]), stoi(args[3]));
             exit_code = 0;
         }
-        else if (command == "--delete-user" && argc == 3) {
+        else if (command == "--delete-user" && argc == 2) {
             // --delete-user <userId>
-            output_json = system.deleteUser(stoi(argv[2]));
+            output_json = system.deleteUser(stoi(args[1]));
             exit_code = 0;
         }
-        else if (command == "--delete-product" && argc == 3) {
+        else if (command == "--delete-users" && argc == 2) {
+            // --delete-users <id,id,...>
+            output_json = system.deleteUsers(parseIdList(args[1]));
+            exit_code = 0;
+        }
+        else if (command == "--delete-product" && argc == 2) {
             // --delete-product <productId>
-            output_json = system.deleteProduct(stoi(argv[2]));
+            output_json = system.deleteProduct(stoi(args[1]));
             exit_code = 0;
         }
-        else if (command == "--add-review" && argc == 6) {
+        else if (command == "--add-review" && argc == 5) {
             // --add-review <userId> <productId> <rating> <comment>
-            output_json = system.addReview(stoi(argv[2]), stoi(argv[3]), stoi(argv[4]), argv[5]);
+            output_json = system.addReview(stoi(args[1]), stoi(args[2]), stoi(args[3]), args[4]);
+            exit_code = 0;
+        }
+        else if ((command == "--snapshot-save" || command == "--snapshot-load") && argc <= 2) {
+            // --snapshot-save [file] | --snapshot-load [file]  (binary snapshot, default snapshot.bin)
+            const string& file = argc == 2 ? args[1] : SNAPSHOT_FILE;
+            output_json = command == "--snapshot-save" ? system.saveSnapshot(file) : system.loadSnapshot(file);
             exit_code = 0;
         }
-        else if (command == "--recommend" && argc == 3) {
-            // --recommend <userId>
-            output_json = system.getRecommendationsJson(stoi(argv[2]));
+        else if (command == "--stats" && argc == 1) {
+            // --stats  (Prometheus text, wrapped in JSON; the CLI prints it unwrapped)
+            JsonWriter stats;
+            stats.raw("{\"status\":\"success\", \"format\":\"prometheus\", \"metrics\":").quoted(system.getStats()).raw('}');
+            output_json = stats.take();
             exit_code = 0;
         }
+        else if (command == "--compact" && argc == 1) {
+            // --compact  (fold mutations.log into the JSON files)
+            output_json = system.compact();
+            exit_code = 0;
+        }
+        else if (command == "--recommend" && argc >= 2 && argc <= 5) {
+            // --recommend <userId> [k] [--strategy category|itemcf]
+            size_t positional = argc;
+            string strategy = "category";
+            if (argc >= 4 && args[argc - 2] == "--strategy") {
+                strategy = args[argc - 1];
+                positional = argc - 2;
+            }
+            if (positional <= 3) {
+                int k = positional == 3 ? stoi(args[2]) : DEFAULT_RECOMMENDATIONS;
+                if (strategy == "category") output_json = system.getRecommendationsJson(stoi(args[1]), k);
+                else if (strategy == "itemcf") output_json = system.getItemCfRecommendationsJson(stoi(args[1]), k);
+                else output_json = "{\"status\":\"error\", \"message\":\"Unknown strategy (category, itemcf).\"}";
+                exit_code = 0;
+            }
+        }
         else {
              // Handle the complex --add command structure for flexibility
-             if (command == "--add" && argc >= 4) {
-                 string resource = argv[2];
-                 if (resource == "user" && argc == 4) {
+             if (command == "--add" && argc == 3) {
+                 const string& resource = args[1];
+                 JsonReader reader(args[2]);
+                 if (resource == "user") {
                      // --add user '{"name": "New User"}'
-                     string raw_json = argv[3];
-                     string name = extractJsonValue(raw_json, "name");
-                     if (!name.empty()) {
+                     string name;
+                     reader.readObject([&](string_view key, JsonReader& value) {
+                         if (key == "name") value.readString(name); else value.skipValue();
+                     });
+                     if (reader.ok() && !name.empty()) {
                         output_json = system.addUser(name); exit_code = 0;
                      }
-                 } else if (resource == "product" && argc == 4) {
+                 } else if (resource == "product") {
                       // --add product '{"name": "X", "category": "Y", "price": 99.99}'
-                      string raw_json = argv[3];
-                      string name = extractJsonValue(raw_json, "name");
-                      string category = extractJsonValue(raw_json, "category");
-                      double price = stod(extractJsonValue(raw_json, "price"));
-                      if (!name.empty() && !category.empty()) {
+                      string name, category;
+                      double price = 0.0;
+                      bool hasPrice = false;
+                      reader.readObject([&](string_view key, JsonReader& value) {
+                          if (key == "name") value.readString(name);
+                          else if (key == "category") value.readString(category);
+                          else if (key == "price") hasPrice = value.readDouble(price);
+                          else value.skipValue();
+                      });
+                      if (reader.ok() && !hasPrice) throw invalid_argument("missing or invalid price");
+                      if (reader.ok() && !name.empty() && !category.empty()) {
                           output_json = system.addProduct(name, category, price); exit_code = 0;
                       }
-                 } else if (resource == "review" && argc == 4) {
+                 } else if (resource == "review") {
                       // --add review '{"user_id": 101, "product_id": 1001, "rating": 5, "comment": "Great!"}'
-                      string raw_json = argv[3];
-                      int userId = stoi(extractJsonValue(raw_json, "user_id"));
-                      int productId = stoi(extractJsonValue(raw_json, "product_id"));
-                      int rating = stoi(extractJsonValue(raw_json, "rating"));
-                      string comment = extractJsonValue(raw_json, "comment");
+                      int userId = 0, productId = 0, rating = 0;
+                      string comment;
+                      bool hasUser = false, hasProduct = false, hasRating = false;
+                      reader.readObject([&](string_view key, JsonReader& value) {
+                          if (key == "user_id") hasUser = value.readInt(userId);
+                          else if (key == "product_id") hasProduct = value.readInt(productId);
+                          else if (key == "rating") hasRating = value.readInt(rating);
+                          else if (key == "comment") value.readString(comment);
+                          else value.skipValue();
+                      });
+                      if (!reader.ok() || !hasUser || !hasProduct || !hasRating) {
+                          throw invalid_argument("review needs numeric user_id, product_id and rating");
+                      }
                       output_json = system.addReview(userId, productId, rating, comment); exit_code = 0;
                  }
-                 
              }
         }
     } catch (const std::exception& e) {
@@ -697,8 +4589,595 @@ int main(int argc, char* argv[]) {
         output_json = "{\"error\": \"An unknown internal C++ error occurred.\"}";
         exit_code = 1;
     }
+    if (streamed && exit_code != 0) {
+        if (out.flushed() != flushedBefore) {
+            // Part of the listing is out already: end its line, the error record follows
+            output_json.insert(output_json.size() - 1, ", \"truncated\":true");
+            out.raw('\n');
+        } else {
+            out.truncate(start); // Nothing was sent, so the error replaces the listing
+        }
+        streamed = false;
+    }
+    if (!streamed) out.raw(output_json);
+    return exit_code;
+}
+
+/**
+ * Runs tagged serve-mode commands on a few worker threads. Replies are written
+ * whole, one line each, under a shared output lock.
+ */
+template <typename System>
+class ServeWorkers {
+private:
+    System& system;
+    ostream& out;
+    mutex& outLock;
+    mutex lock;
+    condition_variable ready, idle;
+    queue<pair<string, vector<string>>> jobs; // (tag, command)
+    size_t running = 0;
+    bool closing = false;
+    vector<thread> threads;
+
+    void work() {
+        unique_lock<mutex> guard(lock);
+        for (;;) {
+            ready.wait(guard, [this]() { return closing || !jobs.empty(); });
+            if (jobs.empty()) return;
+            auto job = move(jobs.front());
+            jobs.pop();
+            running++;
+            guard.unlock();
+
+            {
+                // Streams under outLock once the reply outgrows a chunk, so it stays one line
+                JsonWriter reply(out, &outLock);
+                reply.raw('@').raw(job.first).raw(' ');
+                executeCommand(system, job.second, reply);
+                reply.raw('\n');
+            }
+
+            guard.lock();
+            running--;
+            if (running == 0 && jobs.empty()) idle.notify_all();
+        }
+    }
+
+public:
+    ServeWorkers(System& system, ostream& out, mutex& outLock, size_t count)
+        : system(system), out(out), outLock(outLock) {
+        for (size_t i = 0; i < count; ++i) threads.emplace_back([this]() { work(); });
+    }
+
+    ~ServeWorkers() {
+        {
+            lock_guard<mutex> guard(lock);
+            closing = true;
+        }
+        ready.notify_all();
+        for (auto& t : threads) t.join(); // Queued commands still run before the workers exit
+    }
+
+    void submit(string tag, vector<string> args) {
+        {
+            lock_guard<mutex> guard(lock);
+            jobs.emplace(move(tag), move(args));
+        }
+        ready.notify_one();
+    }
+
+    /** Waits until every submitted command has replied. */
+    void drain() {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this]() { return running == 0 && jobs.empty(); });
+    }
+};
+
+/**
+ * Resident daemon loop: one command per input line, one JSON response per output line.
+ * Data is loaded on the first command and kept in memory; later commands only
+ * re-read a data file if it was changed on disk by someone else.
+ *
+ * A line of the form `@<tag> <command>` runs concurrently with other tagged
+ * commands and is answered by `@<tag> <json>`, possibly out of order. Untagged
+ * commands first wait for all tagged ones to finish and then run alone, so a
+ * client that never tags sees strictly ordered request/response pairs.
+ */
+template <typename System>
+int runServeLoop(System& system, istream& in, ostream& out) {
+    mutex outLock;
+    ServeWorkers<System> workers(system, out, outLock, max<size_t>(2, system.getThreadCount()));
+
+    // Handshake line, so clients can tell a resident engine from a build without
+    // --serve, and a build that understands tags from one that does not
+    out << "{\"status\":\"ready\", \"mode\":\"serve\", \"tagged\":true}" << endl;
+
+    string line;
+    while (getline(in, line)) {
+        string tag;
+        if (!line.empty() && line[0] == '@') {
+            size_t end = line.find_first_of(" \t");
+            tag = line.substr(1, end == string::npos ? string::npos : end - 1);
+            line.erase(0, end == string::npos ? line.size() : end + 1);
+        }
+        auto reply = [&](const string& output_json) {
+            lock_guard<mutex> writing(outLock);
+            if (!tag.empty()) out << "@" << tag << " ";
+            out << output_json << endl; // endl flushes, so the client never waits on a buffered reply
+        };
+
+        vector<string> args;
+        try {
+            args = splitCommandLine(line);
+        } catch (const std::exception& e) {
+            reply("{\"error\": \"Malformed command line.\", \"details\":\"" + escapeJsonString(e.what()) + "\"}");
+            continue;
+        }
+        if (args.empty() && tag.empty()) continue;
+        if (tag.empty() && (args[0] == "quit" || args[0] == "exit")) break;
+
+        if (!args.empty() && args[0] == "--serve") {
+            reply("{\"error\": \"Already running in --serve mode.\"}");
+        } else if (!tag.empty()) {
+            workers.submit(tag, move(args));
+        } else {
+            workers.drain();
+            JsonWriter streaming(out, &outLock);
+            executeCommand(system, args, streaming);
+            streaming.raw('\n');
+            streaming.finish(); // Flushes, so the client never waits on a buffered reply
+        }
+    }
+    workers.drain();
+    return 0;
+}
+
+// --- Benchmark ---
+// `--bench` generates a synthetic catalog in a scratch directory, times the core
+// operations against it and reports latency percentiles and throughput as JSON.
+
+struct BenchConfig {
+    size_t products = 10000;
+    size_t users = 10000;
+    size_t reviews = 100000;
+    size_t categories = 20;
+    double zipf = 1.0;        // Exponent of the product popularity distribution
+    size_t iterations = 1000; // Timed calls of each read operation
+    size_t writes = 100;      // Timed --add-review calls
+    size_t loadRuns = 3;      // Timed full loads and saves
+    uint64_t seed = 42;
+    string dir;               // Empty: a fresh temp directory, removed afterwards
+};
+
+/**
+ * Samples product positions with Zipfian popularity: position i is drawn with
+ * weight 1 / (i + 1)^s, so the first products of the catalog are the bestsellers.
+ */
+class ZipfSampler {
+private:
+    vector<double> cumulative;
+    uniform_real_distribution<double> uniform;
+
+public:
+    ZipfSampler(size_t count, double exponent) {
+        cumulative.reserve(count);
+        double total = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            total += 1.0 / pow(static_cast<double>(i + 1), exponent);
+            cumulative.push_back(total);
+        }
+        uniform = uniform_real_distribution<double>(0.0, total);
+    }
+
+    template <typename Rng>
+    size_t operator()(Rng& rng) {
+        auto it = upper_bound(cumulative.begin(), cumulative.end(), uniform(rng));
+        return min(static_cast<size_t>(it - cumulative.begin()), cumulative.size() - 1);
+    }
+};
+
+/**
+ * Writes products.json, users.json, reviews.json and an empty purchases.json for
+ * `config` into the current directory, in the format saveData writes. The last `config.writes` users get no
+ * reviews, so the timed --add-review calls never hit an existing pair. Returns the
+ * number of reviews written, which is below `config.reviews` only if the reviewing
+ * users cannot hold that many distinct (user, product) pairs.
+ */
+size_t writeBenchData(const BenchConfig& config) {
+    mt19937_64 rng(config.seed);
+    auto writeRecords = [](const string& filename, size_t count, const auto& record) {
+        ofstream file(filename, ios::binary | ios::trunc);
+        if (!file.is_open()) throw runtime_error("cannot write " + filename);
+        JsonWriter out(file);
+        out.raw("[\n");
+        for (size_t i = 0; i < count; ++i) {
+            record(out, i);
+            out.raw(i + 1 < count ? ",\n" : "\n");
+        }
+        out.raw("]");
+        out.finish();
+        if (!file) throw runtime_error("cannot write " + filename);
+    };
+
+    uniform_int_distribution<int> cents(100, 50000);
+    writeRecords(PRODUCTS_FILE, config.products, [&](JsonWriter& out, size_t i) {
+        out.raw("{\"id\":").number(1000 + i)
+           .raw(",\"name\":\"Product ").number(i)
+           .raw("\",\"category\":\"Category ").number(i % config.categories)
+           .raw("\",\"price\":").fixed(cents(rng) / 100.0, 2).raw('}');
+    });
+    writeRecords(USERS_FILE, config.users, [](JsonWriter& out, size_t i) {
+        out.raw("{\"id\":").number(100 + i).raw(",\"name\":\"User ").number(i).raw("\"}");
+    });
+    writeRecords(PURCHASES_FILE, 0, [](JsonWriter&, size_t) {});
+
+    // Reviews are spread evenly over the reviewing users, each picking distinct products
+    static const char* const comments[] = {"Great", "Good value", "Okay", "Not for me", "Broke after a week"};
+    size_t reviewers = config.users - min(config.writes, config.users);
+    size_t perUser = reviewers == 0 ? 0 : min(config.reviews / reviewers + 1, config.products);
+    ZipfSampler popularity(config.products, config.zipf);
+    uniform_int_distribution<int> rating(1, 5);
+    uniform_int_distribution<size_t> comment(0, size(comments) - 1);
+    unordered_set<size_t> picked;
+    uniform_int_distribution<size_t> anyProduct(0, config.products == 0 ? 0 : config.products - 1);
+    size_t written = 0;
+    ofstream file(REVIEWS_FILE, ios::binary | ios::trunc);
+    if (!file.is_open()) throw runtime_error("cannot write " + REVIEWS_FILE);
+    JsonWriter out(file);
+    out.raw("[\n");
+    for (size_t u = 0; u < reviewers && written < config.reviews; ++u) {
+        size_t quota = min(perUser, (config.reviews - written + (reviewers - u) - 1) / (reviewers - u));
+        picked.clear();
+        auto review = [&](size_t product) {
+            if (!picked.insert(product).second) return;
+            if (written++ > 0) out.raw(",\n");
+            out.raw("{\"user_id\":").number(100 + u)
+               .raw(",\"product_id\":").number(1000 + product)
+               .raw(",\"rating\":").number(rating(rng))
+               .raw(",\"comment\":").quoted(comments[comment(rng)]).raw('}');
+        };
+        for (size_t attempt = 0; picked.size() < quota && attempt < quota * 8; ++attempt) review(popularity(rng));
+        // A heavy user can exhaust the popular head; fill the quota from a random
+        // starting product onwards, which quota <= products guarantees
+        for (size_t product = anyProduct(rng); picked.size() < quota; product = (product + 1) % config.products) review(product);
+    }
+    out.raw(written > 0 ? "\n]" : "]");
+    out.finish();
+    if (!file) throw runtime_error("cannot write " + REVIEWS_FILE);
+    return written;
+}
+
+/** Milliseconds taken by each call of one operation; reported as a JSON object. */
+class LatencySample {
+private:
+    vector<double> millis;
+    chrono::steady_clock::time_point started;
+
+public:
+    void start() { started = chrono::steady_clock::now(); }
+    void stop() { millis.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - started).count()); }
+
+    template <typename Operation>
+    void time(Operation&& operation) {
+        start();
+        operation();
+        stop();
+    }
+
+    void toJson(JsonWriter& out) {
+        sort(millis.begin(), millis.end());
+        double total = accumulate(millis.begin(), millis.end(), 0.0);
+        auto percentile = [this](double p) {
+            return millis.empty() ? 0.0 : millis[min(millis.size() - 1, static_cast<size_t>(p * millis.size()))];
+        };
+        out.raw("{\"runs\":").number(millis.size())
+           .raw(",\"p50_ms\":").fixed(percentile(0.50), 3)
+           .raw(",\"p99_ms\":").fixed(percentile(0.99), 3)
+           .raw(",\"max_ms\":").fixed(millis.empty() ? 0.0 : millis.back(), 3)
+           .raw(",\"ops_per_sec\":").fixed(total > 0 ? millis.size() * 1000.0 / total : 0.0, 1)
+           .raw('}');
+    }
+};
+
+/**
+ * --bench [--products N] [--users N] [--reviews N] [--categories N] [--zipf S]
+ *         [--iterations N] [--writes N] [--load-runs N] [--seed N] [--dir D]
+ *
+ * Times loading the data files, --compact (a full save), --get products,
+ * --recommend for random users and --add-review (a durable log append each).
+ * The data is generated in `--dir` if given (and left there), else in a temp
+ * directory that is removed afterwards. `--dir` must be missing or empty, so a
+ * real data directory is never overwritten.
+ */
+int runBench(const vector<string>& args, size_t threads, ostream& out) {
+    BenchConfig config;
+    try {
+        if (args.size() % 2 == 0) throw invalid_argument("option without a value");
+        auto count = [](const string& value) {
+            long long parsed = stoll(value);
+            if (parsed < 0) throw invalid_argument("negative count");
+            return static_cast<size_t>(parsed);
+        };
+        for (size_t i = 1; i < args.size(); i += 2) {
+            const string& option = args[i];
+            const string& value = args[i + 1];
+            if (option == "--products") config.products = count(value);
+            else if (option == "--users") config.users = count(value);
+            else if (option == "--reviews") config.reviews = count(value);
+            else if (option == "--categories") config.categories = count(value);
+            else if (option == "--zipf") config.zipf = stod(value);
+            else if (option == "--iterations") config.iterations = count(value);
+            else if (option == "--writes") config.writes = count(value);
+            else if (option == "--load-runs") config.loadRuns = count(value);
+            else if (option == "--seed") config.seed = count(value);
+            else if (option == "--dir") config.dir = value;
+            else throw invalid_argument("unknown option " + option);
+        }
+        if (config.products == 0 || config.users == 0 || config.categories == 0) {
+            throw invalid_argument("products, users and categories must be positive");
+        }
+    } catch (const std::exception& e) {
+        out << "{\"status\":\"error\", \"message\":\"Invalid bench option.\", \"details\":\"" << escapeJsonString(e.what()) << "\"}" << endl;
+        return 1;
+    }
+
+    namespace fs = filesystem;
+    bool scratch = config.dir.empty();
+    fs::path dir = scratch ? fs::temp_directory_path() / ("recbench-" + to_string(random_device{}()))
+                           : fs::path(config.dir);
+    fs::path home = fs::current_path();
+    error_code unusable;
+    if (!scratch && fs::exists(dir, unusable) && !fs::is_empty(dir, unusable)) {
+        out << "{\"status\":\"error\", \"message\":\"Bench directory is not empty.\"}" << endl;
+        return 1;
+    }
+    JsonWriter report;
+    bool succeeded = false;
+    try {
+        fs::create_directories(dir);
+        fs::current_path(dir); // The data file names are relative
+
+        LatencySample generate, load, save, getProducts, recommend, addReview;
+        size_t reviewsWritten = 0;
+        generate.time([&]() { reviewsWritten = writeBenchData(config); });
+
+        // Each load starts from a fresh system, as a new CLI process would
+        for (size_t i = 0; i < config.loadRuns; ++i) {
+            RecommendationSystem fresh;
+            fresh.setThreadCount(threads);
+            load.time([&]() { fresh.preload(); });
+        }
+
+        RecommendationSystem system;
+        system.setThreadCount(threads);
+        system.preload();
+        mt19937_64 rng(config.seed + 1);
+        JsonWriter response;
+        size_t responseBytes = 0;
+        for (size_t i = 0; i < config.iterations; ++i) {
+            response.clear();
+            getProducts.time([&]() { system.writeProductsJson(response); });
+            responseBytes = response.size();
+        }
+
+        uniform_int_distribution<int> anyUser(100, static_cast<int>(100 + config.users - 1));
+        for (size_t i = 0; i < config.iterations; ++i) {
+            int userId = anyUser(rng);
+            recommend.time([&]() { system.getRecommendationsJson(userId); });
+        }
+
+        // Fresh (user, product) pairs: the generator left the last users without reviews
+        ZipfSampler popularity(config.products, config.zipf);
+        size_t writers = min(config.writes, config.users);
+        size_t rejected = 0;
+        for (size_t i = 0; i < writers; ++i) {
+            int userId = static_cast<int>(100 + config.users - writers + i);
+            int productId = static_cast<int>(1000 + popularity(rng));
+            bool added = false;
+            addReview.time([&]() { system.addReview(userId, productId, 4, "Benchmark review", &added); });
+            if (!added) rejected++;
+        }
+
+        for (size_t i = 0; i < config.loadRuns; ++i) save.time([&]() { system.compact(); });
+
+        report.raw("{\"status\":\"success\", \"config\":{\"products\":").number(config.products)
+              .raw(",\"users\":").number(config.users)
+              .raw(",\"reviews\":").number(reviewsWritten)
+              .raw(",\"reviews_requested\":").number(config.reviews)
+              .raw(",\"categories\":").number(config.categories)
+              .raw(",\"zipf\":").fixed(config.zipf, 2)
+              .raw(",\"seed\":").number(config.seed)
+              .raw(",\"threads\":").number(system.getThreadCount())
+              .raw("}, \"data_bytes\":").number(fs::file_size(PRODUCTS_FILE) + fs::file_size(USERS_FILE) + fs::file_size(REVIEWS_FILE))
+              .raw(", \"products_response_bytes\":").number(responseBytes)
+              .raw(", \"add_review_rejected\":").number(rejected)
+              .raw(", \"results\":{\"generate\":");
+        generate.toJson(report);
+        report.raw(",\"load_data\":");
+        load.toJson(report);
+        report.raw(",\"save_data\":");
+        save.toJson(report);
+        report.raw(",\"get_products\":");
+        getProducts.toJson(report);
+        report.raw(",\"recommend\":");
+        recommend.toJson(report);
+        report.raw(",\"add_review\":");
+        addReview.toJson(report);
+        report.raw("}");
+        if (!scratch) report.raw(", \"dir\":").quoted(dir.string());
+        report.raw('}');
+        succeeded = true;
+    } catch (const std::exception& e) {
+        report.clear();
+        report.raw("{\"status\":\"error\", \"message\":\"Benchmark failed.\", \"details\":\"").escaped(e.what()).raw("\"}");
+    }
+
+    error_code ignored;
+    fs::current_path(home, ignored);
+    if (scratch) fs::remove_all(dir, ignored);
+    out << report.view() << endl;
+    return succeeded ? 0 : 1;
+}
+
+// --- MAIN ENTRY POINT ---
+int main(int argc, char* argv[]) {
+    ios_base::sync_with_stdio(false);
+    cin.tie(NULL);
+
+    RecommendationSystem system;
+
+    if (argc < 2) {
+        cout << "{\"error\": \"No command provided. Usage: ./main <command> [args...]\"}" << endl;
+        return 1;
+    }
+
+    vector<string> args(argv + 1, argv + argc);
+
+    // Leading options, each followed by the command to run:
+    //   --threads <n>          (threads for the bulk rebuilds, 0 = one per core)
+    //   --snapshot-load <file> (start from a binary snapshot)
+    //   --shards <root>        (serve the shard directories under root, see ShardRouter)
+    //   --cache-mb <n>         (memory for cached --recommend replies, 0 = no cache)
+    string shardRoot;
+    while (args.size() > 2) {
+        if (args[0] == "--threads") {
+            size_t threads = 0;
+            auto parsed = from_chars(args[1].data(), args[1].data() + args[1].size(), threads);
+            if (parsed.ec != errc() || parsed.ptr != args[1].data() + args[1].size()) {
+                cout << "{\"status\":\"error\", \"message\":\"Invalid thread count.\"}" << endl;
+                return 1;
+            }
+            system.setThreadCount(threads);
+        } else if (args[0] == "--cache-mb") {
+            size_t megabytes = 0;
+            auto parsed = from_chars(args[1].data(), args[1].data() + args[1].size(), megabytes);
+            if (parsed.ec != errc() || parsed.ptr != args[1].data() + args[1].size()) {
+                cout << "{\"status\":\"error\", \"message\":\"Invalid cache size.\"}" << endl;
+                return 1;
+            }
+            system.setRecommendationCacheBudget(megabytes << 20);
+        } else if (args[0] == "--shards") {
+            shardRoot = args[1];
+        } else if (args[0] == "--snapshot-load") {
+            bool loaded = false;
+            system.loadSnapshot(args[1], &loaded);
+            if (!loaded) {
+                cerr << "DEBUG C++: Snapshot " << args[1] << " not used, reading the JSON files instead." << endl;
+            }
+        } else {
+            break;
+        }
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    if (!shardRoot.empty()) {
+        ShardRouter router(shardRoot);
+        if (router.size() == 0) {
+            cout << "{\"status\":\"error\", \"message\":\"No shard directories found.\"}" << endl;
+            return 1;
+        }
+        router.setThreadCount(system.getThreadCount());
+        if (args[0] == "--serve" && args.size() == 1) {
+            router.preload();
+            return runServeLoop(router, cin, cout);
+        }
+        if (args[0] == "--stats" && args.size() == 1) {
+            cout << router.getStats();
+            return 0;
+        }
+        JsonWriter output(cout);
+        int exit_code = executeCommand(router, args, output);
+        output.raw('\n');
+        output.finish();
+        return exit_code;
+    }
+
+    if (args[0] == "--split-shards" && args.size() == 3) {
+        // --split-shards <n> <root>  (writes root/shard-0 ... for --shards)
+        size_t count = 0;
+        auto parsed = from_chars(args[1].data(), args[1].data() + args[1].size(), count);
+        if (parsed.ec != errc() || parsed.ptr != args[1].data() + args[1].size()) {
+            cout << "{\"status\":\"error\", \"message\":\"Invalid shard count (n >= 1).\"}" << endl;
+            return 1;
+        }
+        cout << system.exportShards(args[2], count) << endl;
+        return 0;
+    }
+
+    if (args[0] == "--serve" && args.size() == 1) {
+        // --serve  (reads commands such as `--get products` from stdin until EOF or `quit`)
+        return runServeLoop(system, cin, cout);
+    }
+
+    if (args[0] == "--stats" && args.size() == 1) {
+        // --stats  (Prometheus text for this process: mostly the cost of its own load)
+        cout << system.getStats();
+        return 0;
+    }
+
+    if (args[0] == "--bench") {
+        // --bench [options]  (synthetic data in a scratch directory, see runBench)
+        return runBench(args, system.getThreadCount(), cout);
+    }
+
+    if (args[0] == "--batch" && args.size() == 2) {
+        // --batch <file|->  (one JSON command per line, see RecommendationSystem::runBatch)
+        ifstream file;
+        if (args[1] != "-") {
+            file.open(args[1], ios::binary);
+            if (!file.is_open()) {
+                cout << "{\"status\":\"error\", \"message\":\"Cannot open batch file.\"}" << endl;
+                return 1;
+            }
+        }
+        cout << system.runBatch(args[1] == "-" ? cin : file, cout) << endl;
+        return 0;
+    }
+
+    if (args[0] == "--recommend-all" || args[0] == "--recommend-users") {
+        // --recommend-all [k] [--strategy category|itemcf]
+        // --recommend-users <id,id,...> [k] [--strategy category|itemcf]
+        size_t positional = args.size();
+        string strategy = "category";
+        if (positional >= 3 && args[positional - 2] == "--strategy") {
+            strategy = args[positional - 1];
+            positional -= 2;
+        }
+        size_t first = args[0] == "--recommend-users" ? 2 : 1; // Index of the optional k
+        if (strategy != "category" && strategy != "itemcf") {
+            cout << "{\"status\":\"error\", \"message\":\"Unknown strategy (category, itemcf).\"}" << endl;
+            return 1;
+        }
+        if (positional < first || positional > first + 1) {
+            cout << "{\"error\": \"Invalid command or missing parameters.\"}" << endl;
+            return 1;
+        }
+
+        vector<int> userIds;
+        int k = DEFAULT_RECOMMENDATIONS;
+        try {
+            if (first == 2) userIds = parseIdList(args[1]);
+            if (positional == first + 1) k = stoi(args[first]);
+        } catch (const std::exception& e) {
+            cout << "{\"error\": \"Processing failed: Invalid argument format or internal error.\", \"details\":\"" << escapeJsonString(e.what()) << "\"}" << endl;
+            return 1;
+        }
+        try {
+            cout << system.recommendForUsers(first == 2 ? &userIds : nullptr, k, strategy, cout) << endl;
+        } catch (const std::exception& e) {
+            // The lines written so far are whole ones; the summary line says the run stopped
+            cout << "{\"status\":\"error\", \"message\":\"Recommendations stopped by an internal error.\", \"details\":\""
+                 << escapeJsonString(e.what()) << "\"}" << endl;
+            return 1;
+        }
+        return 0;
+    }
 
-    // Print the final JSON output to stdout
-    cout << output_json << endl;
+    // Print the JSON output to stdout, large listings chunk by chunk
+    JsonWriter output(cout);
+    int exit_code = executeCommand(system, args, output);
+    output.raw('\n');
+    output.finish();
     return exit_code;
 }
@@ -1,7 +1,8 @@
 import json
-from flask import Flask, jsonify, request
+from flask import Flask, Response, jsonify, request
 import subprocess
 import os
+import threading
 from flask_cors import CORS
 
 # Initialize Flask app
@@ -9,16 +10,14 @@ app = Flask(__name__)
 CORS(app)
 
 # --- Helper Function to run the C++ backend ---
-def run_cpp_command(args):
+def find_cpp_executable():
     """
-    Runs the compiled C++ program with given arguments and expects clean JSON output.
-    Returns (data, status_code).
+    Returns the absolute path of the compiled C++ program next to server.py, or '' if missing.
     """
     # Determine the directory of the currently running server.py script
     base_dir = os.path.dirname(os.path.abspath(__file__))
 
     # 1. Check for common executable names/paths using the absolute base directory
-    executable_path = ''
     possible_names = [
         'main.exe',
         'recommendation_system.exe',
@@ -30,16 +29,188 @@ def run_cpp_command(args):
         full_path = os.path.join(base_dir, name)
         if os.path.exists(full_path):
             # FOUND IT! Use the absolute path for robustness.
-            executable_path = full_path
-            break
+            return full_path
+
+    print(f"ERROR: C++ executable not found.")
+    print(f"Checked directory: {base_dir}")
+    print("Please ensure your compiled file (main.exe, main, recommendation_system.exe, or recommendation_system) is in the same directory as server.py.")
+    return ''
+
+
+def engine_options():
+    """
+    Leading options for every engine command: RECSYS_SHARDS=<root> serves a data
+    root split with `main --split-shards <n> <root>` (see ShardRouter in main.cpp),
+    and RECSYS_CACHE_MB=<n> sets the memory for cached recommendations (0 = none).
+    """
+    options = []
+    cache_mb = os.environ.get('RECSYS_CACHE_MB')
+    if cache_mb:
+        options.extend(['--cache-mb', cache_mb])
+    shards = os.environ.get('RECSYS_SHARDS')
+    if shards:
+        options.extend(['--shards', shards])
+    return options
+
+
+def quote_cpp_arg(arg):
+    """
+    Quotes one argument for the `--serve` line protocol (see splitCommandLine in main.cpp).
+    """
+    escaped = (str(arg).replace('\\', '\\\\').replace('"', '\\"')
+               .replace('\n', '\\n').replace('\r', '\\r').replace('\t', '\\t'))
+    return '"' + escaped + '"'
+
+
+class CppEngine:
+    """
+    Keeps one `main --serve` process alive, so requests skip process startup and the
+    full JSON reload. Each command is one stdin line and its reply is one stdout line.
+    Builds that announce "tagged" in their banner get `@<tag> ` prefixed commands, so
+    concurrent Flask requests are answered in parallel (replies may come back out of
+    order); older builds get one command at a time.
+    """
+    def __init__(self):
+        self.process = None
+        self.unsupported = False  # Set when the executable is an older build without --serve
+        self.tagged = False
+        self.lock = threading.Lock()        # Guards process start/stop (and untagged I/O)
+        self.write_lock = threading.Lock()  # One writer on stdin at a time
+        self.pending = {}                   # tag -> [threading.Event, reply line]
+        self.next_tag = 0
+
+    def _start(self, executable_path):
+        self.process = subprocess.Popen(
+            [executable_path] + engine_options() + ['--serve'],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            text=True,
+            encoding='utf-8',
+            bufsize=1
+        )
+        banner = self.process.stdout.readline()
+        if '"ready"' not in banner:
+            self._stop()
+            self.unsupported = True
+            print("DEBUG: C++ executable has no --serve mode, falling back to one process per request.")
+            return
+        self.tagged = '"tagged":true' in banner
+        if self.tagged:
+            threading.Thread(target=self._read_replies, args=(self.process,), daemon=True).start()
+
+    def _stop(self):
+        if self.process is not None:
+            self.process.kill()
+            self.process.wait()
+        self.process = None
+
+    def _read_replies(self, process):
+        """Hands each `@<tag> <json>` line to the request waiting for that tag."""
+        for line in process.stdout:
+            tag, _, reply = line.strip().partition(' ')
+            waiter = self.pending.get(tag[1:]) if tag.startswith('@') else None
+            if waiter is not None:
+                waiter[1] = reply
+                waiter[0].set()
+        # The engine exited: wake everyone still waiting, they get None
+        for waiter in list(self.pending.values()):
+            waiter[0].set()
+
+    def _ensure_running(self, executable_path):
+        with self.lock:
+            if self.unsupported:
+                return False
+            if self.process is None or self.process.poll() is not None:
+                self._start(executable_path)
+            return not self.unsupported
+
+    def run(self, executable_path, args):
+        """
+        Returns the raw output line for `args`, or None if the resident engine is unavailable.
+        """
+        try:
+            if not self._ensure_running(executable_path):
+                return None
+            command = ' '.join(quote_cpp_arg(a) for a in args)
+            if not self.tagged:
+                with self.lock:
+                    self.process.stdin.write(command + '\n')
+                    self.process.stdin.flush()
+                    line = self.process.stdout.readline()
+                if not line:
+                    raise RuntimeError("C++ engine exited")
+                return line.strip()
+
+            waiter = [threading.Event(), None]
+            with self.write_lock:
+                self.next_tag += 1
+                tag = 't' + str(self.next_tag)
+                self.pending[tag] = waiter
+                self.process.stdin.write('@' + tag + ' ' + command + '\n')
+                self.process.stdin.flush()
+            try:
+                answered = waiter[0].wait(timeout=60)
+            finally:
+                self.pending.pop(tag, None)
+            if not answered:
+                raise RuntimeError("C++ engine did not answer")
+            if waiter[1] is None:
+                raise RuntimeError("C++ engine exited")
+            return waiter[1]
+        except (OSError, RuntimeError, AttributeError) as e:
+            print(f"DEBUG: Resident C++ engine failed ({e}), restarting on next request.")
+            with self.lock:
+                self._stop()
+            return None
+
+
+cpp_engine = CppEngine()
 
+
+def parse_cpp_output(output, stderr_output=''):
+    """
+    Turns the C++ stdout text into (data, status_code).
+    """
+    if not output:
+        # If C++ returns nothing, check stderr for errors
+        if stderr_output:
+            return {"error": "C++ execution failed (check server logs)", "stderr": stderr_output}, 500
+        return {"error": "C++ returned no output."}, 500
+
+    # Try to parse JSON output
+    try:
+        data = json.loads(output)
+        return data, 200
+    except json.JSONDecodeError:
+        # A listing that failed after part of it was streamed ends with its error on a line of its own
+        last_line = output.rsplit('\n', 1)[-1]
+        try:
+            data = json.loads(last_line)
+            if isinstance(data, dict) and data.get("truncated"):
+                return data, 500
+        except json.JSONDecodeError:
+            pass
+        # This happens if C++ outputs non-JSON text (like an error message or status line)
+        return {"error": "Invalid JSON from C++", "raw_output": output}, 500
+
+
+def run_cpp_command(args):
+    """
+    Runs the compiled C++ program with given arguments and expects clean JSON output.
+    Uses the resident `--serve` engine when available, otherwise spawns one process.
+    Returns (data, status_code).
+    """
+    executable_path = find_cpp_executable()
     if not executable_path:
-        print(f"ERROR: C++ executable not found.")
-        print(f"Checked directory: {base_dir}")
-        print("Please ensure your compiled file (main.exe, main, recommendation_system.exe, or recommendation_system) is in the same directory as server.py.")
         return {"error": "C++ executable not found. Please compile main.cpp first."}, 500
 
-    command = [executable_path] + args
+    output = cpp_engine.run(executable_path, args)
+    if output is not None:
+        print(f"DEBUG: Engine command: {args}")
+        print(f"DEBUG: Raw C++ Output: {output}")
+        return parse_cpp_output(output)
+
+    command = [executable_path] + engine_options() + args
 
     try:
         # NOTE: Using text=True and encoding='utf-8' for clean text capture
@@ -56,20 +227,7 @@ def run_cpp_command(args):
         print(f"DEBUG: Command: {command}")
         print(f"DEBUG: Raw C++ Output: {output}")
 
-        if not output:
-            # If C++ returns nothing, check stderr for errors
-            error_output = result.stderr.strip()
-            if error_output:
-                return {"error": "C++ execution failed (check server logs)", "stderr": error_output}, 500
-            return {"error": "C++ returned no output."}, 500
-
-        # Try to parse JSON output
-        try:
-            data = json.loads(output)
-            return data, 200
-        except json.JSONDecodeError:
-            # This happens if C++ outputs non-JSON text (like an error message or status line)
-            return {"error": "Invalid JSON from C++", "raw_output": output}, 500
+        return parse_cpp_output(output, result.stderr.strip())
 
     except subprocess.TimeoutExpired:
         return {"error": "C++ execution timed out."}, 504
@@ -86,13 +244,30 @@ def index():
         "message": "E-Commerce Recommendation System API connected with C++ backend."
     })
     
+@app.route('/metrics', methods=['GET'])
+def metrics():
+    # C++ command: --stats (Prometheus text; serve mode wraps it as {"metrics": "..."})
+    # (as a one-off process it prints the text unwrapped, which arrives as raw_output)
+    data, status = run_cpp_command(['--stats'])
+    text = data.get('metrics', data.get('raw_output'))
+    if text is None:
+        return jsonify(data), status
+    return Response(text, mimetype='text/plain; version=0.0.4')
+
 # --- GET ROUTES ---
 
 @app.route("/get/products", methods=["GET"])
 @app.route("/getProducts", methods=["GET"])
 def get_products():
     # C++ command: ./main.exe --get products
-    data, status = run_cpp_command(["--get", "products"])
+    #   [--offset N] [--limit M] [--category C] [--min-rating R] [--sort id|rating|price] [--cursor X]
+    args = ["--get", "products"]
+    for param, option in (("offset", "--offset"), ("limit", "--limit"), ("category", "--category"),
+                          ("min_rating", "--min-rating"), ("sort", "--sort"), ("cursor", "--cursor")):
+        value = request.args.get(param)
+        if value is not None:
+            args.extend([option, str(value)])
+    data, status = run_cpp_command(args)
     return jsonify(data), status
 
 @app.route('/get/users', methods=['GET'])
@@ -168,8 +343,15 @@ def recommend():
     if userId is None:
         return jsonify({"error": "Missing userId"}), 400
     
-    # C++ command: --recommend <userId>
-    data, status = run_cpp_command(['--recommend', str(userId)])
+    # C++ command: --recommend <userId> [k] [--strategy category|itemcf]
+    args = ['--recommend', str(userId)]
+    k = request.args.get('k')
+    if k is not None:
+        args.append(str(k))
+    strategy = request.args.get('strategy')
+    if strategy is not None:
+        args.extend(['--strategy', str(strategy)])
+    data, status = run_cpp_command(args)
     return jsonify(data), status
 
 @app.route('/add/product', methods=['POST'])
@@ -201,6 +383,20 @@ def delete_user(user_id):
         return jsonify({"error": f"Error deleting user: {str(e)}"}), 400
 
 
+@app.route('/delete/users', methods=['POST'])
+def delete_users():
+    try:
+        data = request.get_json()
+        if not data or not isinstance(data.get('ids'), list):
+            return jsonify({"error": "Missing list of user ids in request body."}), 400
+        # C++ command: --delete-users <id,id,...> (one log record for the whole list)
+        ids = ','.join(str(int(user_id)) for user_id in data['ids'])
+        result, status = run_cpp_command(['--delete-users', ids])
+        return jsonify(result), status
+    except Exception as e:
+        return jsonify({"error": f"Error deleting users: {str(e)}"}), 400
+
+
 @app.route('/delete/product/<int:product_id>', methods=['DELETE'])
 @app.route('/deleteProduct/<int:product_id>', methods=['DELETE'])
 def delete_product(product_id):